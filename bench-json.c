@@ -0,0 +1,305 @@
+/*
+ * Compare the JSON parsing engines
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * Usage: bench-json [SIZE-IN-KB [ITERATIONS]]
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gvariant-json.h"
+#include "json-lexer.h"
+#include "json-streamer.h"
+
+static char *make_document(size_t size)
+{
+    GString *str = g_string_sized_new(size + 256);
+    int i;
+
+    g_string_append_c(str, '[');
+    for (i = 0; str->len < size; i++) {
+        g_string_append_printf(str,
+            "%s{\"id\": %d, \"name\": \"record number %d, \\\"quoted\\\"\", "
+            "\"value\": %d.%02d, \"ok\": %s, \"tags\": [\"alpha\", \"beta\"], "
+            "\"nested\": {\"x\": -%d, \"y\": [1, 2, 3]}}",
+            i ? ",\n " : "", i, i, i / 100, i % 100,
+            i & 1 ? "true" : "false", i % 7);
+    }
+    g_string_append_c(str, ']');
+    return g_string_free(str, FALSE);
+}
+
+static GVariant *bench(const char *name, const char *doc, size_t len,
+                       GVariantJSONFlags flags, int iterations)
+{
+    GVariant *obj = NULL;
+    gint64 start, elapsed;
+    int i;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        if (obj) {
+            g_variant_unref(obj);
+        }
+        obj = g_variant_from_json_full(doc, len, flags);
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    printf("%-24s %8.2f ms/iter %8.2f MB/s\n", name,
+           elapsed / 1000.0 / iterations,
+           (double) len * iterations / elapsed);
+    return obj;
+}
+
+static size_t n_tokens;
+
+static void count_token(JSONLexer *lexer, const JSONToken *token)
+{
+    n_tokens++;
+}
+
+static size_t bench_lexer(const char *name, const char *doc, size_t len,
+                          int threads, int iterations)
+{
+    JSONLexer lexer;
+    gint64 start, elapsed;
+    int i;
+
+    n_tokens = 0;
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        json_lexer_init(&lexer, count_token, JSON_LEXER_LAZY_POSITION);
+        json_lexer_set_threads(&lexer, threads);
+        json_lexer_feed(&lexer, doc, len);
+        json_lexer_flush(&lexer);
+        json_lexer_destroy(&lexer);
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    printf("%-24s %8.2f ms/iter %8.2f MB/s\n", name,
+           elapsed / 1000.0 / iterations,
+           (double) len * iterations / elapsed);
+    return n_tokens / iterations;
+}
+
+/* Return the records of DOC, one per line.  */
+static char **split_records(const char *doc, size_t len)
+{
+    char *body = g_strndup(doc + 1, len - 2);
+    char **lines = g_strsplit(body, ",\n ", -1);
+
+    g_free(body);
+    return lines;
+}
+
+/* Parse the records of DOC one per line, separately and as a batch.  */
+static bool bench_batch(const char *doc, size_t len, int iterations)
+{
+    char **lines = split_records(doc, len);
+    char *ndjson = g_strjoinv("\n", lines);
+    size_t ndjson_len = strlen(ndjson);
+    guint n_lines = g_strv_length(lines);
+    GPtrArray *values = NULL;
+    gint64 start, elapsed;
+    guint n_parsed = 0;
+    int i;
+    guint j;
+
+    /* Keep the values in both cases, as a real consumer would.  */
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        if (values) {
+            g_ptr_array_free(values, TRUE);
+        }
+        values = g_ptr_array_new_with_free_func(
+            (GDestroyNotify) g_variant_unref);
+        for (j = 0; j < n_lines; j++) {
+            GVariant *obj = g_variant_from_json(lines[j]);
+
+            n_parsed += obj != NULL;
+            g_ptr_array_add(values, g_variant_ref_sink(obj));
+        }
+    }
+    g_ptr_array_free(values, TRUE);
+    values = NULL;
+    elapsed = g_get_monotonic_time() - start;
+    printf("%-24s %8.2f ms/iter %8.2f MB/s\n", "one call per line",
+           elapsed / 1000.0 / iterations,
+           (double) ndjson_len * iterations / elapsed);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        const char *buffers[] = { ndjson };
+
+        if (values) {
+            g_ptr_array_free(values, TRUE);
+        }
+        values = g_variant_from_json_batch(buffers, &ndjson_len, 1,
+                                           G_VARIANT_JSON_NDJSON, NULL);
+    }
+    elapsed = g_get_monotonic_time() - start;
+    printf("%-24s %8.2f ms/iter %8.2f MB/s\n", "batch, NDJSON",
+           elapsed / 1000.0 / iterations,
+           (double) ndjson_len * iterations / elapsed);
+
+    j = values->len;
+    g_ptr_array_free(values, TRUE);
+    g_free(ndjson);
+    g_strfreev(lines);
+    return n_parsed == n_lines * iterations && j == n_lines;
+}
+
+static size_t n_values;
+
+static void count_value(JSONMessageParser *parser, GVariant *value)
+{
+    if (value) {
+        n_values++;
+        g_variant_unref(g_variant_ref_sink(value));
+    }
+}
+
+/* Stream the records of DOC through a message parser, 64 KiB at a time.  */
+static size_t bench_pipeline(const char *name, const char *doc, size_t len,
+                             unsigned workers, int iterations)
+{
+    char **lines = split_records(doc, len);
+    char *stream = g_strjoinv(" ", lines);
+    size_t stream_len = strlen(stream);
+    JSONMessageParser parser;
+    gint64 start, elapsed;
+    size_t n;
+    int i;
+
+    n_values = 0;
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        json_message_parser_init(&parser, count_value, NULL, 0);
+        json_message_parser_set_workers(&parser, workers);
+        for (n = 0; n < stream_len; n += 65536) {
+            json_message_parser_feed(&parser, stream + n,
+                                     MIN(65536, stream_len - n));
+        }
+        json_message_parser_flush(&parser);
+        json_message_parser_destroy(&parser);
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    printf("%-24s %8.2f ms/iter %8.2f MB/s\n", name,
+           elapsed / 1000.0 / iterations,
+           (double) stream_len * iterations / elapsed);
+    g_free(stream);
+    g_strfreev(lines);
+    return n_values / iterations;
+}
+
+#define BENCH_FORMAT "{'execute': %s, 'arguments': {'id': %d, 'ok': %i}}"
+
+static GVariant *format_relexed(const char *format, ...)
+{
+    GVariant *obj;
+    va_list ap;
+
+    va_start(ap, format);
+    obj = g_variant_from_jsonv(format, &ap);
+    va_end(ap);
+    return obj;
+}
+
+/* Build N messages from the same format, lexing it each time or not.  */
+static bool bench_format(int n)
+{
+    GVariant *relexed = NULL, *compiled = NULL;
+    gint64 start, elapsed;
+    bool same;
+    int i;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < n; i++) {
+        if (relexed) {
+            g_variant_unref(relexed);
+        }
+        relexed = format_relexed(BENCH_FORMAT, "query-status", i, i & 1);
+    }
+    elapsed = g_get_monotonic_time() - start;
+    printf("%-24s %8.2f us/call\n", "format, lexed",
+           (double) elapsed / n);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < n; i++) {
+        if (compiled) {
+            g_variant_unref(compiled);
+        }
+        compiled = g_variant_from_jsonf(BENCH_FORMAT, "query-status", i,
+                                        i & 1);
+    }
+    elapsed = g_get_monotonic_time() - start;
+    printf("%-24s %8.2f us/call\n", "format, compiled",
+           (double) elapsed / n);
+
+    same = g_variant_equal(relexed, compiled);
+    g_variant_unref(relexed);
+    g_variant_unref(compiled);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = (argc > 1 ? atoi(argv[1]) : 4096) * 1024;
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+    GVariant *streamed, *indexed, *inferred;
+    char *doc;
+    size_t len;
+
+    doc = make_document(size);
+    len = strlen(doc);
+    printf("document: %zu bytes, %d iterations\n", len, iterations);
+
+    streamed = bench("lexer+streamer+parser", doc, len, 0, iterations);
+    indexed = bench("structural index", doc, len,
+                    G_VARIANT_JSON_INDEXED, iterations);
+    inferred = bench("structural index, ax/as", doc, len,
+                     G_VARIANT_JSON_INDEXED | G_VARIANT_JSON_INFER_ARRAYS,
+                     iterations);
+    printf("value size: %zu bytes, %zu with inferred arrays\n",
+           g_variant_get_size(indexed), g_variant_get_size(inferred));
+    g_variant_unref(inferred);
+
+    if (bench_lexer("lexer only", doc, len, 1, iterations) !=
+        bench_lexer("lexer only, threaded", doc, len,
+                    g_get_num_processors(), iterations)) {
+        printf("token counts differ!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!bench_batch(doc, len, iterations)) {
+        printf("batch results differ!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bench_pipeline("message stream", doc, len, 0, iterations) !=
+        bench_pipeline("message stream, workers", doc, len,
+                       g_get_num_processors(), iterations)) {
+        printf("pipeline results differ!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!bench_format(iterations * 10000)) {
+        printf("format results differ!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!streamed || !indexed || !g_variant_equal(streamed, indexed)) {
+        printf("results differ!\n");
+        return EXIT_FAILURE;
+    }
+
+    g_variant_unref(streamed);
+    g_variant_unref(indexed);
+    g_free(doc);
+    return EXIT_SUCCESS;
+}
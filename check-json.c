@@ -15,6 +15,8 @@
 
 #include "gvariant-utils.h"
 #include "gvariant-json.h"
+#include "json-streamer.h"
+#include "json-parser.h"
 
 START_TEST(escaped_string)
 {
@@ -38,6 +40,8 @@ START_TEST(escaped_string)
         { "\"single byte utf-8 \\u0020\"", "single byte utf-8  ", .skip = 1 },
         { "\"double byte utf-8 \\u00A2\"", "double byte utf-8 \xc2\xa2" },
         { "\"triple byte utf-8 \\u20AC\"", "triple byte utf-8 \xe2\x82\xac" },
+        { "\"quadruple byte utf-8 \\uD83D\\uDE00\"",
+          "quadruple byte utf-8 \xf0\x9f\x98\x80" },
         {}
     };
 
@@ -127,6 +131,33 @@ START_TEST(single_quote_string)
 }
 END_TEST
 
+START_TEST(long_string)
+{
+    GString *encoded = g_string_new("\"");
+    GString *decoded = g_string_new("");
+    GVariant *obj;
+    int i;
+
+    /* Put escapes at all offsets relative to a 16- or 32-byte block.  */
+    for (i = 0; i < 200; i++) {
+        g_string_append_len(encoded, "abcdefghijklmnopqrstuvwxyz0123456789", i % 37);
+        g_string_append_len(decoded, "abcdefghijklmnopqrstuvwxyz0123456789", i % 37);
+        g_string_append(encoded, i & 1 ? "\\n" : "\\u00A2'");
+        g_string_append(decoded, i & 1 ? "\n" : "\xc2\xa2'");
+    }
+    g_string_append_c(encoded, '"');
+
+    obj = g_variant_from_json(encoded->str);
+    fail_unless(obj != NULL);
+    fail_unless(g_variant_is_of_type(obj, G_VARIANT_TYPE_STRING));
+    fail_unless(strcmp(g_variant_get_string(obj, NULL), decoded->str) == 0);
+    g_variant_unref(obj);
+
+    g_string_free(encoded, TRUE);
+    g_string_free(decoded, TRUE);
+}
+END_TEST
+
 START_TEST(vararg_string)
 {
     int i;
@@ -166,6 +197,10 @@ START_TEST(simple_number)
         { "1", 1 },
         { "-32", -32 },
         { "-0", 0, .skip = 1 },
+        { "9223372036854775807", INT64_MAX },
+        { "-9223372036854775808", INT64_MIN },
+        { "9223372036854775808", INT64_MAX, .skip = 1 },
+        { "-123456789012345678901", INT64_MIN, .skip = 1 },
         { },
     };
 
@@ -628,6 +663,1231 @@ START_TEST(simple_varargs)
 }
 END_TEST
 
+START_TEST(format_template)
+{
+    const char *names[] = { "query-status", "cont", "stop" };
+    GVariant *embedded_obj, *obj, *expected;
+    char *str;
+    int i;
+
+    /* The same format, compiled once, with different arguments.  */
+    for (i = 0; i < 3; i++) {
+        obj = g_variant_from_jsonf("{'execute': %s, 'arguments': "
+                                   "{'id': %d, %s: [%i, %f, 'x']}}",
+                                   names[i], i, names[i], i & 1, i * 0.5);
+        str = g_strdup_printf("{\"execute\": \"%s\", \"arguments\": "
+                              "{\"id\": %d, \"%s\": [%s, %s, \"x\"]}}",
+                              names[i], i, names[i],
+                              i & 1 ? "true" : "false",
+                              i == 0 ? "0.0" : i == 1 ? "0.5" : "1.0");
+        expected = g_variant_from_json(str);
+        fail_unless(obj != NULL);
+        fail_unless(g_variant_equal(obj, expected));
+        g_variant_unref(obj);
+        g_variant_unref(expected);
+        g_free(str);
+    }
+
+    /* Holes can take any value, even in constant positions.  */
+    for (i = 0; i < 2; i++) {
+        embedded_obj = g_variant_from_json(i ? "{\"a\": [1]}" : "2");
+        obj = g_variant_from_jsonf("[%p, %ld, %lld]", embedded_obj,
+                                   (long) -i, (long long) i << 40);
+        str = g_variant_to_json(obj);
+        fail_unless(strcmp(str, i ? "[{\"a\": [1]}, -1, 1099511627776]"
+                                  : "[2, 0, 0]") == 0);
+        g_variant_unref(obj);
+        free(str);
+    }
+
+    /* Only the last value is kept, but all of them take arguments.  */
+    obj = g_variant_from_jsonf("%s {%s: [%d, 'y']} %i", "x", "k", 1, true);
+    fail_unless(g_variant_get_boolean(obj));
+    g_variant_unref(obj);
+    obj = g_variant_from_jsonf("%p 'y' %f 3", g_variant_new_int64(1), 2.0);
+    fail_unless(g_variant_get_int64(obj) == 3);
+    g_variant_unref(obj);
+
+    /* A constant on its own belongs to the caller.  */
+    for (i = 0; i < 2; i++) {
+        obj = g_variant_ref_sink(g_variant_from_jsonf("'fixed'"));
+        fail_unless(strcmp(g_variant_get_string(obj, NULL), "fixed") == 0);
+        g_variant_unref(obj);
+    }
+    obj = g_variant_from_jsonf("-12");
+    fail_unless(g_variant_get_int64(obj) == -12);
+    g_variant_unref(obj);
+}
+END_TEST
+
+typedef struct SplitFeedState
+{
+    JSONMessageParser parser;
+    GVariant *result;
+} SplitFeedState;
+
+static void split_feed_emit(JSONMessageParser *parser, GVariant *value)
+{
+    SplitFeedState *s = container_of(parser, SplitFeedState, parser);
+
+    if (s->result) {
+        g_variant_unref(s->result);
+    }
+    s->result = value;
+}
+
+START_TEST(split_feed)
+{
+    const char *encoded = "{'abc': [12345, -6.5e3, true, \"x\\u00A2y\"], "
+                          "\"quite a long key\": {\"def\": 'g\xc3\xa9"
+                          "\xe2\x82\xac\xf0\x9f\x98\x80i'}}";
+    size_t len = strlen(encoded);
+    GVariant *expected;
+    size_t chunk, i;
+
+    expected = g_variant_from_json(encoded);
+    fail_unless(expected != NULL);
+
+    /* Make tokens straddle the boundaries at every position.  */
+    for (chunk = 1; chunk <= len; chunk++) {
+        SplitFeedState s = {};
+
+        json_message_parser_init(&s.parser, split_feed_emit, NULL, 0);
+        for (i = 0; i < len; i += chunk) {
+            GBytes *bytes = g_bytes_new(encoded + i, MIN(chunk, len - i));
+            json_message_parser_feed_bytes(&s.parser, bytes);
+            g_bytes_unref(bytes);
+        }
+        json_message_parser_flush(&s.parser);
+        json_message_parser_destroy(&s.parser);
+
+        fail_unless(s.result != NULL);
+        fail_unless(g_variant_equal(s.result, expected));
+        g_variant_unref(s.result);
+    }
+
+    g_variant_unref(expected);
+}
+END_TEST
+
+typedef struct MessageStreamState
+{
+    JSONMessageParser parser;
+    int count;
+} MessageStreamState;
+
+static void message_stream_emit(JSONMessageParser *parser, GVariant *obj)
+{
+    MessageStreamState *s = container_of(parser, MessageStreamState, parser);
+    GVariant *value;
+    const char *str;
+    size_t len;
+
+    fail_unless(obj != NULL);
+    fail_unless(g_variant_lookup(obj, "n", "x", NULL));
+    value = g_variant_lookup_value(obj, "s", G_VARIANT_TYPE_STRING);
+    fail_unless(value != NULL);
+
+    /* Every tenth message has a string that spans several feeds.  */
+    str = g_variant_get_string(value, &len);
+    fail_unless(len == (s->count % 10 ? 3 : 10000));
+    fail_unless(str[0] == 'a' + s->count % 26);
+
+    g_variant_unref(value);
+    g_variant_unref(obj);
+    s->count++;
+}
+
+START_TEST(message_stream)
+{
+    MessageStreamState s = {};
+    GString *encoded = g_string_new(NULL);
+    size_t i;
+
+    for (i = 0; i < 100; i++) {
+        g_string_append_printf(encoded, "{\"n\": %zu, \"s\": \"%c%*s\"}\n",
+                               i, (char) ('a' + i % 26),
+                               i % 10 ? 2 : 9999, "");
+    }
+
+    json_message_parser_init(&s.parser, message_stream_emit, NULL, 0);
+    for (i = 0; i < encoded->len; i += 777) {
+        json_message_parser_feed(&s.parser, encoded->str + i,
+                                 MIN(777, encoded->len - i));
+    }
+    json_message_parser_destroy(&s.parser);
+    fail_unless(s.count == 100);
+
+    g_string_free(encoded, TRUE);
+}
+END_TEST
+
+typedef struct MessageErrorsState
+{
+    JSONMessageParser parser;
+    GPtrArray *results;
+} MessageErrorsState;
+
+static void message_errors_emit(JSONMessageParser *parser, GVariant *value)
+{
+    MessageErrorsState *s = container_of(parser, MessageErrorsState, parser);
+
+    g_ptr_array_add(s->results, value ? g_variant_ref_sink(value) : NULL);
+}
+
+START_TEST(message_errors)
+{
+    static const char *expected[] = {
+        NULL, "{\"a\": [true]}", NULL, "3", NULL, "[[], {}]",
+    };
+    const char *encoded = "[1 2] {\"a\": [true]} ] 3 {1: [{}]} [[], {}]";
+    MessageErrorsState s = {};
+    size_t i;
+
+    /* A bad message is skipped up to its closing bracket.  */
+    s.results = g_ptr_array_new();
+    json_message_parser_init(&s.parser, message_errors_emit, NULL, 0);
+    for (i = 0; encoded[i]; i++) {
+        json_message_parser_feed(&s.parser, encoded + i, 1);
+    }
+    json_message_parser_destroy(&s.parser);
+
+    fail_unless(s.results->len == G_N_ELEMENTS(expected));
+    for (i = 0; i < G_N_ELEMENTS(expected); i++) {
+        GVariant *value = g_ptr_array_index(s.results, i);
+
+        if (!expected[i]) {
+            fail_unless(value == NULL);
+        } else {
+            GVariant *obj = g_variant_from_json(expected[i]);
+
+            fail_unless(value != NULL);
+            fail_unless(g_variant_equal(value, obj));
+            g_variant_unref(obj);
+            g_variant_unref(value);
+        }
+    }
+    g_ptr_array_free(s.results, TRUE);
+}
+END_TEST
+
+static GPtrArray *pipeline_results(const char *encoded, size_t chunk,
+                                   unsigned n_workers)
+{
+    JSONLimits limits = { .max_depth = 3 };
+    MessageErrorsState s = {};
+    size_t i, len = strlen(encoded);
+
+    s.results = g_ptr_array_new();
+    json_message_parser_init(&s.parser, message_errors_emit, NULL, 0);
+    json_message_parser_set_limits(&s.parser, &limits);
+    json_message_parser_set_workers(&s.parser, n_workers);
+    for (i = 0; i < len; i += chunk) {
+        json_message_parser_feed(&s.parser, encoded + i, MIN(chunk, len - i));
+    }
+    json_message_parser_flush(&s.parser);
+    json_message_parser_destroy(&s.parser);
+    return s.results;
+}
+
+START_TEST(pipeline_order)
+{
+    GString *encoded = g_string_new(NULL);
+    GPtrArray *expected, *actual;
+    size_t i, j;
+
+    /* Values of very different sizes, so workers finish out of order.  */
+    for (i = 0; i < 300; i++) {
+        switch (i % 5) {
+        case 0:
+            g_string_append_printf(encoded, "{\"n\": %zu, \"s\": \"%*s\"}",
+                                   i, (int) (i * 37 % 5000), "");
+            break;
+        case 1:
+            g_string_append_printf(encoded, " [%zu, [true, {}], -%zu.5]", i, i);
+            break;
+        case 2:
+            g_string_append_printf(encoded, " %zu\n", i);
+            break;
+        case 3:
+            /* A syntax error, and a value that is too deep.  */
+            g_string_append(encoded, i % 2 ? "{1: [{}]}" : "[[[[0]]]]");
+            break;
+        default:
+            g_string_append(encoded, "\"x\" ");
+            break;
+        }
+    }
+    g_string_append(encoded, "[1, ");
+
+    expected = pipeline_results(encoded->str, 4096, 0);
+    fail_unless(expected->len == 301);
+    for (j = 1; j <= 4; j *= 2) {
+        actual = pipeline_results(encoded->str, 1000 * j - 1, j);
+        fail_unless(actual->len == expected->len);
+        for (i = 0; i < expected->len; i++) {
+            GVariant *a = g_ptr_array_index(actual, i);
+            GVariant *b = g_ptr_array_index(expected, i);
+
+            fail_unless(a ? b && g_variant_equal(a, b) : !b);
+            if (a) {
+                g_variant_unref(a);
+            }
+        }
+        g_ptr_array_free(actual, TRUE);
+    }
+
+    for (i = 0; i < expected->len; i++) {
+        if (g_ptr_array_index(expected, i)) {
+            g_variant_unref(g_ptr_array_index(expected, i));
+        }
+    }
+    g_ptr_array_free(expected, TRUE);
+    g_string_free(encoded, TRUE);
+}
+END_TEST
+
+typedef struct MessageLimitsState
+{
+    JSONMessageParser parser;
+    GString *results;
+} MessageLimitsState;
+
+/*
+ * Record a digit for each limit that was hit, or the value.  Members of
+ * split objects are written as key=value.
+ */
+static void message_limits_emit(JSONMessageParser *parser, GVariant *value)
+{
+    MessageLimitsState *s = container_of(parser, MessageLimitsState, parser);
+
+    if (value && g_variant_is_of_type(value, G_VARIANT_TYPE("{sv}"))) {
+        GVariant *member;
+        const char *key;
+
+        g_variant_get(value, "{&sv}", &key, &member);
+        g_string_append_printf(s->results, "%s=", key);
+        g_variant_unref(g_variant_ref_sink(value));
+        value = member;
+    }
+    if (value) {
+        char *str = g_variant_to_json(value);
+
+        g_string_append(s->results, str);
+        g_free(str);
+        g_variant_unref(value);
+    } else {
+        g_string_append_printf(s->results, "%d", parser->parser.limit);
+    }
+    g_string_append_c(s->results, ' ');
+}
+
+START_TEST(message_limits)
+{
+    static const struct {
+        JSONLimits limits;
+        const char *json;
+        const char *expected;
+    } test_cases[] = {
+        { { .max_depth = 3 }, "[[[1]]] [[[[1]]]] {'a': {'b': {'c': {}}}}",
+          "[[[1]]] 1 1 " },
+        { { .max_tokens = 8 }, "[1, 2, 3] [1, 2, 3, 4] 5", "[1, 2, 3] 2 5 " },
+        { { .max_bytes = 16 }, "['abcdef'] ['abcdefghijklmn'] 'x'",
+          "[\"abcdef\"] 3 \"x\" " },
+        { { .max_bytes = 16 }, "'abcdefghijklmnopqrstu' 5", "3 5 " },
+        { { .max_memory = 400 }, "[[], [], []] [[], [], [], [], [], [], []] 1",
+          "[[], [], []] 4 1 " },
+        { }
+    };
+    int i;
+
+    for (i = 0; test_cases[i].json; i++) {
+        MessageLimitsState s = {};
+        const char *p;
+
+        s.results = g_string_new(NULL);
+        json_message_parser_init(&s.parser, message_limits_emit, NULL, 0);
+        json_message_parser_set_limits(&s.parser, &test_cases[i].limits);
+        for (p = test_cases[i].json; *p; p++) {
+            json_message_parser_feed(&s.parser, p, 1);
+        }
+        json_message_parser_flush(&s.parser);
+        json_message_parser_destroy(&s.parser);
+
+        fail_unless(strcmp(s.results->str, test_cases[i].expected) == 0);
+        g_string_free(s.results, TRUE);
+    }
+}
+END_TEST
+
+typedef struct ResyncState
+{
+    JSONMessageParser parser;
+    GString *results;
+} ResyncState;
+
+/* Record each value, or the bytes that were dropped.  */
+static void resync_emit(JSONMessageParser *parser, GVariant *value)
+{
+    ResyncState *s = container_of(parser, ResyncState, parser);
+
+    if (value) {
+        char *str = g_variant_to_json(value);
+
+        g_string_append(s->results, str);
+        g_free(str);
+        g_variant_unref(value);
+    } else {
+        g_string_append_printf(s->results, "%zu-%zu",
+                               parser->drop_start, parser->drop_end);
+    }
+    g_string_append_c(s->results, ' ');
+}
+
+START_TEST(resync_errors)
+{
+    static const struct {
+        const char *encoded;
+        const char *expected;
+        size_t max_bytes;
+    } tests[] = {
+        { "{\"a\": [1, @ 2]} 3 [4] \"x\377y\" {\"b\": 5} 6\n"
+          "{\"c\": [7]} [8, -} 9] @@\n\"ok\" ~",
+          "0-15 3 [4] 22-39 {\"c\": [7]} 50-59 60-63 \"ok\" 68-69 " },
+        /* The bad byte itself closes or opens a container.  */
+        { "[1,-] [2] {\"a\": [-]} {\"b\": 4}",
+          "0-5 [2] 10-20 {\"b\": 4} " },
+        { "[1, -[2]] 3",
+          "0-9 3 " },
+        /* Values that workers rejected do not report the next drop.  */
+        { "[1 2] [@] {\"a\" 1}[@][3 4] @\n5",
+          "0-0 6-9 0-0 17-20 0-0 26-28 5 " },
+        /* A value that was rejected already is not reported again.  */
+        { "[\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+          "aaaaaaa\", \"\377\"] 1",
+          "0-0 1 ", 60 },
+    };
+    int i, n_workers, chunk;
+
+    for (i = 0; i < G_N_ELEMENTS(tests); i++) {
+        for (n_workers = 0; n_workers <= 2; n_workers += 2) {
+            for (chunk = 1; chunk <= 64; chunk *= 4) {
+                ResyncState s = {};
+                JSONLimits limits = { .max_bytes = tests[i].max_bytes };
+                const char *encoded = tests[i].encoded;
+                size_t j, len = strlen(encoded);
+
+                s.results = g_string_new(NULL);
+                json_message_parser_init(&s.parser, resync_emit, NULL, 0);
+                json_message_parser_set_resync(&s.parser, true);
+                json_message_parser_set_workers(&s.parser, n_workers);
+                json_message_parser_set_limits(&s.parser, &limits);
+                for (j = 0; j < len; j += chunk) {
+                    fail_unless(json_message_parser_feed(&s.parser,
+                                                         encoded + j,
+                                                         MIN(chunk,
+                                                             len - j)) == 0);
+                }
+                fail_unless(json_message_parser_flush(&s.parser) == 0);
+                json_message_parser_destroy(&s.parser);
+
+                fail_unless(strcmp(s.results->str, tests[i].expected) == 0);
+                g_string_free(s.results, TRUE);
+            }
+        }
+    }
+}
+END_TEST
+
+typedef struct RawState
+{
+    JSONMessageParser parser;
+    GString *results;
+    /* If not NULL, the only buffer that is fed.  */
+    GBytes *input;
+} RawState;
+
+static void raw_emit(JSONMessageParser *parser, GVariant *value)
+{
+    RawState *s = container_of(parser, RawState, parser);
+    GBytes *raw = json_message_parser_get_raw(parser);
+    gsize size, input_size;
+    const char *data = g_bytes_get_data(raw, &size);
+
+    fail_unless(size == parser->value_end - parser->value_start);
+    if (s->input) {
+        /* The value was not copied.  */
+        const char *input = g_bytes_get_data(s->input, &input_size);
+
+        fail_unless(data == input + parser->value_start);
+    }
+    g_string_append_len(s->results, data, size);
+    g_string_append_c(s->results, '|');
+    g_bytes_unref(raw);
+    g_variant_unref(g_variant_ref_sink(value));
+}
+
+START_TEST(raw_values)
+{
+    static const struct {
+        size_t split_depth;
+        unsigned n_workers;
+        const char *expected;
+    } tests[] = {
+        { 0, 0, "[1, \"x\", {\"k\": [2]}]|{\"a\": true}|-4.5|false|" },
+        { 0, 2, "[1, \"x\", {\"k\": [2]}]|{\"a\": true}|-4.5|false|" },
+        { 1, 0, "1|\"x\"|{\"k\": [2]}|\"a\": true|-4.5|false|" },
+    };
+    const char *encoded = " [1, \"x\", {\"k\": [2]}]\n{\"a\": true} -4.5 false";
+    size_t len = strlen(encoded);
+    int i, chunk;
+
+    for (i = 0; i < G_N_ELEMENTS(tests); i++) {
+        for (chunk = 0; chunk <= 7; chunk++) {
+            RawState s = {};
+            size_t j;
+
+            s.results = g_string_new(NULL);
+            json_message_parser_init(&s.parser, raw_emit, NULL, 0);
+            json_message_parser_set_raw(&s.parser, true);
+            json_message_parser_set_split_depth(&s.parser, tests[i].split_depth);
+            json_message_parser_set_workers(&s.parser, tests[i].n_workers);
+            if (!chunk) {
+                s.input = g_bytes_new_static(encoded, len);
+                json_message_parser_feed_bytes(&s.parser, s.input);
+            } else {
+                for (j = 0; j < len; j += chunk) {
+                    json_message_parser_feed(&s.parser, encoded + j,
+                                             MIN(chunk, len - j));
+                }
+            }
+            json_message_parser_flush(&s.parser);
+            json_message_parser_destroy(&s.parser);
+
+            fail_unless(strcmp(s.results->str, tests[i].expected) == 0);
+            g_string_free(s.results, TRUE);
+            if (s.input) {
+                g_bytes_unref(s.input);
+            }
+        }
+    }
+}
+END_TEST
+
+static void lanes_emit(JSONMessageParser *parser, GVariant *value)
+{
+    RawState *s = container_of(parser, RawState, parser);
+    GBytes *raw = json_message_parser_get_raw(parser);
+    gsize size;
+    const char *data = g_bytes_get_data(raw, &size);
+
+    g_string_append_len(s->results, data, size);
+    g_string_append_c(s->results, '|');
+    g_bytes_unref(raw);
+    g_variant_unref(g_variant_ref_sink(value));
+}
+
+START_TEST(priority_lanes)
+{
+    const char *encoded =
+        "{\"event\": \"a\"} {\"execute\": \"x\", \"id\": 1} "
+        "{\"event\": \"b\"} [1] {\"execute\": \"y\"} {\"return\": {}} 5 ";
+    const char *expected =
+        "{\"execute\": \"x\", \"id\": 1}|{\"execute\": \"y\"}|"
+        "{\"event\": \"a\"}|{\"event\": \"b\"}|[1]|{\"return\": {}}|5|"
+        "{\"event\": \"c\"}|{\"execute\": \"z\"}|{\"event\": \"d\"}|";
+    int n_workers;
+
+    for (n_workers = 0; n_workers <= 2; n_workers += 2) {
+        GMainContext *context = g_main_context_new();
+        RawState s = {};
+
+        s.results = g_string_new(NULL);
+        json_message_parser_init(&s.parser, lanes_emit, NULL, 0);
+        json_message_parser_set_raw(&s.parser, true);
+        json_message_parser_set_workers(&s.parser, n_workers);
+        json_message_parser_add_lane(&s.parser, "execute", G_PRIORITY_HIGH,
+                                     context);
+        json_message_parser_add_lane(&s.parser, NULL, G_PRIORITY_LOW,
+                                     context);
+
+        /* Nothing is passed to FUNC until the context runs.  */
+        json_message_parser_feed(&s.parser, encoded, strlen(encoded));
+        fail_unless(s.results->len == 0);
+        while (g_main_context_iteration(context, FALSE)) {
+        }
+
+        /* A command that comes later overtakes the queued events.  */
+        json_message_parser_feed(&s.parser, "{\"event\": \"c\"}"
+                                 "{\"event\": \"d\"}", 28);
+        g_main_context_iteration(context, FALSE);
+        json_message_parser_feed(&s.parser, "{\"execute\": \"z\"}", 16);
+        while (g_main_context_iteration(context, FALSE)) {
+        }
+
+        json_message_parser_destroy(&s.parser);
+        g_main_context_unref(context);
+        fail_unless(strcmp(s.results->str, expected) == 0);
+        g_string_free(s.results, TRUE);
+    }
+}
+END_TEST
+
+START_TEST(split_elements)
+{
+    static const struct {
+        size_t depth;
+        JSONLimits limits;
+        const char *json;
+        const char *expected;
+    } test_cases[] = {
+        { 1, { }, "[1, {'a': [2]}, [3, 4]] 5 {'k': 6, 'l': [7]} []",
+          "1 {\"a\": [2]} [3, 4] 5 k=6 l=[7] " },
+        { 2, { }, "[[1, 2], 3, [[4]], {'a': {}}] {'b': [8], 'c': {'d': 9}}",
+          "1 2 3 [4] a={} 8 d=9 " },
+        { 1, { }, "[1, [2 3], 4, :, 5] 6", "1 0 4 0 5 6 " },
+        { 1, { .max_tokens = 6 }, "[[1, 2], [1, 2, 3, 4], 5]",
+          "[1, 2] 2 5 " },
+        { 1, { .max_depth = 2 }, "[[1], [[2]], 3]", "[1] 1 3 " },
+        { }
+    };
+    int i;
+
+    for (i = 0; test_cases[i].json; i++) {
+        MessageLimitsState s = {};
+        const char *p;
+
+        s.results = g_string_new(NULL);
+        json_message_parser_init(&s.parser, message_limits_emit, NULL, 0);
+        json_message_parser_set_split_depth(&s.parser, test_cases[i].depth);
+        json_message_parser_set_limits(&s.parser, &test_cases[i].limits);
+        for (p = test_cases[i].json; *p; p++) {
+            json_message_parser_feed(&s.parser, p, 1);
+        }
+        json_message_parser_flush(&s.parser);
+        json_message_parser_destroy(&s.parser);
+
+        fail_unless(strcmp(s.results->str, test_cases[i].expected) == 0);
+        g_string_free(s.results, TRUE);
+    }
+}
+END_TEST
+
+START_TEST(endless_string)
+{
+    JSONLimits limits = { .max_bytes = 4096 };
+    MessageLimitsState s = {};
+    char buf[1000];
+    int i;
+
+    memset(buf, 'a', sizeof(buf));
+    s.results = g_string_new(NULL);
+    json_message_parser_init(&s.parser, message_limits_emit, NULL, 0);
+    json_message_parser_set_limits(&s.parser, &limits);
+
+    /* The string is rejected early, and its text is not kept.  */
+    json_message_parser_feed(&s.parser, "[\"", 2);
+    for (i = 0; i < 1000; i++) {
+        json_message_parser_feed(&s.parser, buf, sizeof(buf));
+        fail_unless(s.parser.lexer.token->len <= 5000);
+    }
+    fail_unless(strcmp(s.results->str, "3 ") == 0);
+
+    json_message_parser_feed(&s.parser, "\"] [7]", 6);
+    json_message_parser_destroy(&s.parser);
+    fail_unless(strcmp(s.results->str, "3 [7] ") == 0);
+    g_string_free(s.results, TRUE);
+}
+END_TEST
+
+START_TEST(ndjson_lines)
+{
+    const char *encoded = "{\"a\": 1}\n"
+                          "[1, 2\n"
+                          "\"abc\n"
+                          "3 4\r\n"
+                          "@ [1]\n"
+                          "\n"
+                          "[1 2] 5\n"
+                          "{\"b\": true}";
+    const char *expected = "{\"a\": 1} 0 0 3 4 0 0 5 {\"b\": true} ";
+    size_t len = strlen(encoded);
+    size_t chunk, i;
+
+    /* A bad line does not affect the ones after it.  */
+    for (chunk = 1; chunk <= len; chunk++) {
+        MessageLimitsState s = {};
+
+        s.results = g_string_new(NULL);
+        json_message_parser_init(&s.parser, message_limits_emit, NULL, 0);
+        json_message_parser_set_ndjson(&s.parser, true);
+        for (i = 0; i < len; i += chunk) {
+            fail_unless(json_message_parser_feed(&s.parser, encoded + i,
+                                                 MIN(chunk, len - i)) == 0);
+        }
+        json_message_parser_flush(&s.parser);
+        json_message_parser_destroy(&s.parser);
+
+        fail_unless(strcmp(s.results->str, expected) == 0);
+        g_string_free(s.results, TRUE);
+    }
+}
+END_TEST
+
+typedef struct AtEndState
+{
+    JSONMessageParser parser;
+    GString *results;
+} AtEndState;
+
+static void at_end_emit(JSONMessageParser *parser, GVariant *value)
+{
+    AtEndState *s = container_of(parser, AtEndState, parser);
+
+    g_string_append_c(s->results, value ? 'v' : parser->at_end ? 'T' : 'N');
+    if (value) {
+        g_variant_unref(g_variant_ref_sink(value));
+    }
+}
+
+START_TEST(flush_at_end)
+{
+    const char *encoded = "[1 2] 3 {\"k\": false} null [4";
+    size_t i, len = strlen(encoded);
+    int chunk;
+
+    for (chunk = 1; chunk <= 64; chunk *= 4) {
+        AtEndState s;
+
+        /* Only the flush may set at_end, whatever was there before.  */
+        memset(&s, 0xff, sizeof(s));
+        s.results = g_string_new(NULL);
+        json_message_parser_init(&s.parser, at_end_emit, NULL, 0);
+        for (i = 0; i < len; i += chunk) {
+            json_message_parser_feed(&s.parser, encoded + i,
+                                     MIN(chunk, len - i));
+        }
+        json_message_parser_flush(&s.parser);
+        json_message_parser_destroy(&s.parser);
+
+        fail_unless(strcmp(s.results->str, "NvvNT") == 0);
+        g_string_free(s.results, TRUE);
+    }
+}
+END_TEST
+
+START_TEST(batch_parse)
+{
+    static const struct {
+        const char *buffers[3];
+        GVariantJSONFlags flags;
+        guint n_values;
+        const char *expected[8];
+        GVariantJSONStatus status[8];
+    } test_cases[] = {
+        { { "1 [2", ", 3] {\"a\"", ": true} [4 5] [\"x" },
+          0, 5, { "1", "[2, 3]", "{\"a\": true}", NULL, NULL },
+          { G_VARIANT_JSON_OK, G_VARIANT_JSON_OK, G_VARIANT_JSON_OK,
+            G_VARIANT_JSON_INVALID, G_VARIANT_JSON_TRUNCATED } },
+        { { "1 @ 2", "3" },
+          0, 2, { "1", NULL },
+          { G_VARIANT_JSON_OK, G_VARIANT_JSON_INVALID } },
+        /* A keyword that only the end of the input ends is not cut short.  */
+        { { "1 xyz" },
+          0, 2, { "1", NULL },
+          { G_VARIANT_JSON_OK, G_VARIANT_JSON_INVALID } },
+        { { "1 xyz " },
+          0, 2, { "1", NULL },
+          { G_VARIANT_JSON_OK, G_VARIANT_JSON_INVALID } },
+        { { "1\n[2,\n3]\n@\n{\"a\":", " [] }\n[" },
+          G_VARIANT_JSON_NDJSON, 7,
+          { "1", NULL, "3", NULL, NULL, "{\"a\": []}", NULL },
+          { G_VARIANT_JSON_OK, G_VARIANT_JSON_INVALID, G_VARIANT_JSON_OK,
+            G_VARIANT_JSON_INVALID, G_VARIANT_JSON_INVALID,
+            G_VARIANT_JSON_OK, G_VARIANT_JSON_TRUNCATED } },
+        { }
+    };
+    int i;
+
+    for (i = 0; test_cases[i].buffers[0]; i++) {
+        const char *const *buffers = test_cases[i].buffers;
+        size_t lengths[3];
+        size_t n, j;
+        GPtrArray *values;
+        GArray *status;
+
+        for (n = 0; n < 3 && buffers[n]; n++) {
+            lengths[n] = strlen(buffers[n]);
+        }
+        status = g_array_new(FALSE, FALSE, sizeof(GVariantJSONStatus));
+        values = g_variant_from_json_batch(buffers, lengths, n,
+                                           test_cases[i].flags, status);
+
+        fail_unless(values->len == test_cases[i].n_values);
+        fail_unless(status->len == test_cases[i].n_values);
+        for (j = 0; j < values->len; j++) {
+            GVariant *value = g_ptr_array_index(values, j);
+            const char *expected = test_cases[i].expected[j];
+
+            fail_unless(g_array_index(status, GVariantJSONStatus, j) ==
+                        test_cases[i].status[j]);
+            if (!expected) {
+                fail_unless(value == NULL);
+            } else {
+                GVariant *obj = g_variant_from_json(expected);
+
+                fail_unless(value != NULL);
+                fail_unless(g_variant_equal(value, obj));
+                g_variant_unref(obj);
+            }
+        }
+
+        g_ptr_array_free(values, TRUE);
+        g_array_free(status, TRUE);
+    }
+}
+END_TEST
+
+typedef struct PositionState
+{
+    JSONLexer lexer;
+    GArray *positions;
+} PositionState;
+
+static void position_emit(JSONLexer *lexer, const JSONToken *token)
+{
+    PositionState *s = container_of(lexer, PositionState, lexer);
+    int pos[2] = { token->x, token->y };
+
+    if (lexer->flags & JSON_LEXER_LAZY_POSITION) {
+        fail_unless(token->x == -1 && token->y == -1);
+        json_lexer_get_position(lexer, token->offset, &pos[0], &pos[1]);
+    }
+    g_array_append_vals(s->positions, pos, 2);
+}
+
+START_TEST(lazy_position)
+{
+    const char *encoded = "{'abc': [1,\n  2.5,\n\n \"x\\ny\"],\n"
+                          " 'def'   :   true}\n\t\t [ @";
+    size_t len = strlen(encoded);
+    PositionState eager, lazy;
+    size_t chunk, i;
+
+    for (chunk = 1; chunk <= len; chunk++) {
+        int eager_err = 0, lazy_err = 0;
+
+        eager.positions = g_array_new(FALSE, FALSE, sizeof(int));
+        lazy.positions = g_array_new(FALSE, FALSE, sizeof(int));
+        json_lexer_init(&eager.lexer, position_emit, 0);
+        json_lexer_init(&lazy.lexer, position_emit, JSON_LEXER_LAZY_POSITION);
+        for (i = 0; i < len && !eager_err; i += chunk) {
+            eager_err = json_lexer_feed(&eager.lexer, encoded + i,
+                                        MIN(chunk, len - i));
+            lazy_err = json_lexer_feed(&lazy.lexer, encoded + i,
+                                       MIN(chunk, len - i));
+        }
+
+        /* The error is on the '@'.  */
+        fail_unless(eager_err == -EINVAL && lazy_err == -EINVAL);
+        fail_unless(eager.lexer.x == 6 && eager.lexer.y == 5);
+        fail_unless(lazy.lexer.x == 6 && lazy.lexer.y == 5);
+
+        fail_unless(eager.positions->len == 2 * 16);
+        fail_unless(lazy.positions->len == eager.positions->len);
+        fail_unless(memcmp(lazy.positions->data, eager.positions->data,
+                           eager.positions->len * sizeof(int)) == 0);
+
+        json_lexer_destroy(&eager.lexer);
+        json_lexer_destroy(&lazy.lexer);
+        g_array_free(eager.positions, TRUE);
+        g_array_free(lazy.positions, TRUE);
+    }
+}
+END_TEST
+
+typedef struct RecordState
+{
+    JSONLexer lexer;
+    GString *log;
+} RecordState;
+
+static void record_emit(JSONLexer *lexer, const JSONToken *token)
+{
+    RecordState *s = container_of(lexer, RecordState, lexer);
+
+    g_string_append_printf(s->log, "%d %.*s %zu %d %d\n", token->type,
+                           (int) token->len, token->str, token->offset,
+                           token->x, token->y);
+}
+
+static int record_tokens(RecordState *s, const char *encoded, int n_chunks)
+{
+    size_t len = strlen(encoded);
+    int err;
+
+    s->log = g_string_new(NULL);
+    json_lexer_init(&s->lexer, record_emit, 0);
+    if (n_chunks) {
+        err = json_lexer_feed_parallel(&s->lexer, encoded, len, n_chunks);
+    } else {
+        err = json_lexer_feed(&s->lexer, encoded, len);
+    }
+    g_string_append_printf(s->log, "%d %d %d\n", err, s->lexer.x, s->lexer.y);
+    json_lexer_destroy(&s->lexer);
+    return err;
+}
+
+START_TEST(parallel_feed)
+{
+    GString *encoded = g_string_new(NULL);
+    int i, n_chunks;
+
+    /* Operators inside strings, after escaped quotes and backslashes.  */
+    for (i = 0; i < 40; i++) {
+        g_string_append_printf(encoded,
+                               "{\"k%d\": [%d, -%d.5, 'a,b', \"{[:]}\\\",\",\n"
+                               "  'it\\'s, [ok]', \"x,\\\\\", \"]\"],\n"
+                               " \"long\": \"%*s,,,,\"}\n",
+                               i, i, i, i * 3, "");
+    }
+
+    for (i = 0; i < 2; i++) {
+        RecordState expected, actual;
+        int err;
+
+        err = record_tokens(&expected, encoded->str, 0);
+        fail_unless(err == (i ? -EINVAL : 0));
+        for (n_chunks = 1; n_chunks <= 32; n_chunks++) {
+            record_tokens(&actual, encoded->str, n_chunks);
+            fail_unless(strcmp(actual.log->str, expected.log->str) == 0);
+            g_string_free(actual.log, TRUE);
+        }
+        g_string_free(expected.log, TRUE);
+
+        /* Now try the same with an error in the middle.  */
+        *strchr(encoded->str + encoded->len / 2, '\n') = '@';
+    }
+
+    g_string_free(encoded, TRUE);
+}
+END_TEST
+
+static void collect_token(JSONLexer *lexer, const JSONToken *token)
+{
+    GArray **tokens = (GArray **) (lexer + 1);
+
+    g_array_append_vals(*tokens, token, 1);
+}
+
+START_TEST(deep_tape)
+{
+    struct {
+        JSONLexer lexer;
+        GArray *tokens;
+    } s;
+    GString *encoded = g_string_new(NULL);
+    GVariant *value, *child;
+    int i, depth = 50000;
+
+    /* Far deeper than the C stack would allow with recursion.  */
+    for (i = 0; i < depth; i++) {
+        g_string_append(encoded, "[1, ");
+    }
+    g_string_append(encoded, "{\"a\": true}");
+    for (i = 0; i < depth; i++) {
+        g_string_append_c(encoded, ']');
+    }
+
+    s.tokens = g_array_new(FALSE, FALSE, sizeof(JSONToken));
+    json_lexer_init(&s.lexer, collect_token, 0);
+    json_lexer_feed(&s.lexer, encoded->str, encoded->len);
+    value = json_parser_parse(s.tokens, NULL);
+    fail_unless(value != NULL);
+    g_variant_ref_sink(value);
+
+    child = g_variant_ref(value);
+    for (i = 0; i < depth; i++) {
+        GVariant *next;
+
+        fail_unless(g_variant_n_children(child) == 2);
+        next = g_variant_get_child_value(child, 1);
+        g_variant_unref(child);
+        child = g_variant_get_variant(next);
+        g_variant_unref(next);
+    }
+    fail_unless(g_variant_is_of_type(child, G_VARIANT_TYPE("a{sv}")));
+    g_variant_unref(child);
+    g_variant_unref(value);
+
+    /* A truncated tape is an error, not a crash.  */
+    g_array_set_size(s.tokens, s.tokens->len - 1);
+    fail_unless(json_parser_parse(s.tokens, NULL) == NULL);
+
+    json_lexer_destroy(&s.lexer);
+    g_array_free(s.tokens, TRUE);
+    g_string_free(encoded, TRUE);
+}
+END_TEST
+
+START_TEST(indexed_parse)
+{
+    int i;
+    const char *test_cases[] = {
+        "[43, -0.5e3, true, false, \"abc\\\\\", [], {}]",
+        " {\"foo\": {\"bar\": [1, {\"baz\": \"\\u00A2\\\"\"}]}} ",
+        "\"a string that is long enough to cross a 64-byte block, "
+        "with \\\\ \\\" escapes \\\\\\\\ around the boundary\"",
+        "-32",
+        /* These fall back to the streaming parser.  */
+        "{'h': 'b'}",
+        "[1, 2] [3]",
+        NULL
+    };
+
+    for (i = 0; test_cases[i]; i++) {
+        size_t len = strlen(test_cases[i]);
+        GVariant *expected, *obj;
+
+        expected = g_variant_from_json(test_cases[i]);
+        obj = g_variant_from_json_full(test_cases[i], len,
+                                       G_VARIANT_JSON_INDEXED);
+        fail_unless(expected != NULL);
+        fail_unless(obj != NULL);
+        fail_unless(g_variant_equal(obj, expected));
+
+        g_variant_unref(obj);
+        g_variant_unref(expected);
+    }
+}
+END_TEST
+
+START_TEST(serialized_form)
+{
+    GVariantBuilder builder;
+    GString *encoded = g_string_new("[");
+    GVariant *expected, *obj;
+    char *str;
+    int i, j;
+    /* Enough elements for one, two and four-byte offsets.  */
+    int sizes[] = { 3, 100, 20000, 0 };
+
+    expected = g_variant_parse(NULL,
+        "{'a': <[<int64 1>, <'x'>, <true>, <@a{sv} {}>]>, 'bb': <@av []>}",
+        NULL, NULL, NULL);
+    obj = g_variant_from_json("{\"a\": [1, \"x\", true, {}], \"bb\": []}");
+    fail_unless(obj != NULL);
+    fail_unless(g_variant_get_size(obj) == g_variant_get_size(expected));
+    fail_unless(memcmp(g_variant_get_data(obj), g_variant_get_data(expected),
+                       g_variant_get_size(obj)) == 0);
+    g_variant_unref(obj);
+    g_variant_unref(expected);
+
+    /* Compare the data with what GVariantBuilder produces.  */
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+    for (i = 0; sizes[i]; i++) {
+        GVariantBuilder inner;
+
+        g_string_append(encoded, i ? ", {" : "{");
+        g_variant_builder_init(&inner, G_VARIANT_TYPE("a{sv}"));
+        for (j = 0; j < sizes[i]; j++) {
+            char key[16];
+
+            snprintf(key, sizeof(key), "k%d", j);
+            g_string_append_printf(encoded, "%s\"%s\": [%d, 0.5]",
+                                   j ? ", " : "", key, j);
+            g_variant_builder_add(&inner, "{sv}", key,
+                                  g_variant_new_parsed("[<int64 %x>, <0.5>]",
+                                                       (gint64) j));
+        }
+        g_string_append_c(encoded, '}');
+        g_variant_builder_add(&builder, "v", g_variant_builder_end(&inner));
+    }
+    g_string_append_c(encoded, ']');
+    expected = g_variant_ref_sink(g_variant_builder_end(&builder));
+
+    obj = g_variant_from_json(encoded->str);
+    fail_unless(obj != NULL);
+    fail_unless(g_variant_get_size(obj) == g_variant_get_size(expected));
+    fail_unless(memcmp(g_variant_get_data(obj), g_variant_get_data(expected),
+                       g_variant_get_size(obj)) == 0);
+    g_variant_unref(obj);
+
+    obj = g_variant_from_json_full(encoded->str, encoded->len,
+                                   G_VARIANT_JSON_INDEXED);
+    fail_unless(obj != NULL);
+    fail_unless(memcmp(g_variant_get_data(obj), g_variant_get_data(expected),
+                       g_variant_get_size(obj)) == 0);
+    g_variant_unref(obj);
+    g_variant_unref(expected);
+
+    /* Deeper values are built differently, but read back the same.  */
+    g_string_truncate(encoded, 0);
+    for (i = 0; i < 50; i++) {
+        g_string_append(encoded, "{\"a\": [1], \"b\": ");
+    }
+    g_string_append(encoded, "2");
+    for (i = 0; i < 50; i++) {
+        g_string_append_c(encoded, '}');
+    }
+    obj = g_variant_from_json(encoded->str);
+    fail_unless(obj != NULL);
+    str = g_variant_to_json(obj);
+    fail_unless(strcmp(str, encoded->str) == 0);
+    g_variant_unref(obj);
+    free(str);
+
+    g_string_free(encoded, TRUE);
+}
+END_TEST
+
+START_TEST(typed_parse)
+{
+    int i;
+    struct {
+        const char *encoded;
+        const char *schema;
+        const char *expected;
+    } test_cases[] = {
+        { "{\"tags\": [\"a\", \"b\"], \"id\": 42, \"name\": \"x\", "
+          "\"scores\": {\"m\": 1.5, \"n\": 2}}",
+          "(name:s id:x scores:a{sd} tags:as)",
+          "('x', int64 42, {'m': 1.5, 'n': 2.0}, ['a', 'b'])" },
+        { "[\"x\", 42, {\"m\": 1.5}, []]", "(sxa{sd}as)",
+          "('x', int64 42, {'m': 1.5}, @as [])" },
+        { "{\"a\": 1, \"extra\": [1, {\"b\": true}]}",
+          "(a:i extra:v opt:ms)",
+          "(1, <[<int64 1>, <{'b': <true>}>]>, @ms nothing)" },
+        { "{\"p\": {\"y\": 2, \"x\": 1}}", "a{s(x:d y:d)}",
+          "{'p': (1.0, 2.0)}" },
+        { "[[1, 2], [3]]", "aay", "@aay [[1, 2], [3]]" },
+        { "\"/org/x\"", "o", "objectpath '/org/x'" },
+        { "5", "mx", "@mx 5" },
+        /* These do not fit the schema.  */
+        { "[1, 256]", "ay" },
+        { "{\"name\": \"x\"}", "(name:s id:x)" },
+        { "{\"name\": \"x\", \"id\": 1, \"z\": 2}", "(name:s id:x)" },
+        { "{\"id\": 1, \"id\": 2}", "(id:x)" },
+        { "{\"id\": \"1\"}", "(id:x)" },
+        { "[1, 2, 3]", "(xx)" },
+        { "[1]", "(xx)" },
+        { "{\"a\": 1}", "ax" },
+        { "\"x\"", "(name:s" },
+        { }
+    };
+
+    for (i = 0; test_cases[i].encoded; i++) {
+        GVariant *obj, *expected;
+
+        obj = g_variant_from_json_typed(test_cases[i].encoded,
+                                        test_cases[i].schema);
+        if (!test_cases[i].expected) {
+            fail_unless(obj == NULL);
+            continue;
+        }
+
+        expected = g_variant_parse(NULL, test_cases[i].expected,
+                                   NULL, NULL, NULL);
+        fail_unless(obj != NULL);
+        fail_unless(g_variant_equal(obj, expected));
+        g_variant_unref(obj);
+        g_variant_unref(expected);
+    }
+}
+END_TEST
+
+START_TEST(infer_arrays)
+{
+    GString *encoded = g_string_new(NULL);
+    GVariant *expected, *obj;
+    char *str;
+    int i, j;
+    struct {
+        const char *encoded;
+        const char *expected;
+    } test_cases[] = {
+        { "[1, 2, 3]", "[int64 1, 2, 3]" },
+        { "[true, false]", "[true, false]" },
+        { "[1.5, 2.5]", "[1.5, 2.5]" },
+        { "[\"a\", \"\", \"bc\"]", "['a', '', 'bc']" },
+        { "[{\"a\": 1}, {}]", "[{'a': <int64 1>}, @a{sv} {}]" },
+        { "{\"a\": [[1], [2]], \"b\": [\"x\"]}",
+          "{'a': <[<[int64 1]>, <[int64 2]>]>, 'b': <['x']>}" },
+        /* Mixed and empty arrays stay av.  */
+        { "[1, 2.5]", "[<int64 1>, <2.5>]" },
+        { "[1, \"x\"]", "[<int64 1>, <'x'>]" },
+        { "[]", "@av []" },
+        { "[[]]", "[<@av []>]" },
+        {}
+    };
+
+    for (i = 0; test_cases[i].encoded; i++) {
+        for (j = 0; j < 2; j++) {
+            const char *s = test_cases[i].encoded;
+
+            expected = g_variant_parse(NULL, test_cases[i].expected,
+                                       NULL, NULL, NULL);
+            obj = g_variant_from_json_full(s, strlen(s),
+                                           G_VARIANT_JSON_INFER_ARRAYS |
+                                           (j ? G_VARIANT_JSON_INDEXED : 0));
+            fail_unless(obj != NULL);
+            fail_unless(g_variant_equal(obj, expected));
+            fail_unless(g_variant_get_size(obj) ==
+                        g_variant_get_size(expected));
+            fail_unless(g_variant_get_size(obj) == 0 ||
+                        memcmp(g_variant_get_data(obj),
+                               g_variant_get_data(expected),
+                               g_variant_get_size(obj)) == 0);
+
+            str = g_variant_to_json(obj);
+            fail_unless(strcmp(str, s) == 0);
+            g_variant_unref(obj);
+            g_variant_unref(expected);
+            free(str);
+        }
+    }
+
+    /* Without the flag, all arrays are av.  */
+    obj = g_variant_from_json("[1, 2, 3]");
+    fail_unless(g_variant_is_of_type(obj, G_VARIANT_TYPE("av")));
+    g_variant_unref(obj);
+
+    /* Enough strings for two-byte offsets.  */
+    g_string_append_c(encoded, '[');
+    for (i = 0; i < 200; i++) {
+        g_string_append_printf(encoded, "%s\"s%d\"", i ? ", " : "", i);
+    }
+    g_string_append_c(encoded, ']');
+    obj = g_variant_from_json_full(encoded->str, encoded->len,
+                                   G_VARIANT_JSON_INFER_ARRAYS);
+    fail_unless(g_variant_is_of_type(obj, G_VARIANT_TYPE("as")));
+    fail_unless(g_variant_n_children(obj) == 200);
+    str = g_variant_to_json(obj);
+    fail_unless(strcmp(str, encoded->str) == 0);
+    g_variant_unref(obj);
+    free(str);
+
+    /* Deep values are inferred too.  */
+    g_string_truncate(encoded, 0);
+    for (i = 0; i < 50; i++) {
+        g_string_append(encoded, "{\"a\": [1, 2], \"b\": ");
+    }
+    g_string_append(encoded, "[true]");
+    for (i = 0; i < 50; i++) {
+        g_string_append_c(encoded, '}');
+    }
+    obj = g_variant_from_json_full(encoded->str, encoded->len,
+                                   G_VARIANT_JSON_INFER_ARRAYS);
+    fail_unless(obj != NULL);
+    str = g_variant_to_json(obj);
+    fail_unless(strcmp(str, encoded->str) == 0);
+    g_variant_unref(obj);
+    free(str);
+
+    g_string_free(encoded, TRUE);
+}
+END_TEST
+
 START_TEST(empty_input)
 {
     const char *empty = "";
@@ -644,6 +1904,54 @@ START_TEST(unterminated_string)
 }
 END_TEST
 
+START_TEST(invalid_utf8)
+{
+    static const char *test_cases[] = {
+        "\"\xc3\x28\"",
+        "\"\xc3\"",
+        "\"\xc0\xaf\"",
+        "\"\xe0\x80\xaf\"",
+        "\"\xed\xa0\x80\"",
+        "\"\xf4\x90\x80\x80\"",
+        "\"\xf0\x9f\x98\"",
+        "'\xff'",
+        "\"\\uD83D\"",
+        "\"\\uDE00\\uD83D\"",
+        "\"\\uD83Dx\\uDE00\"",
+        NULL
+    };
+    int i;
+
+    for (i = 0; test_cases[i]; i++) {
+        GVariant *obj = g_variant_from_json(test_cases[i]);
+        fail_unless(obj == NULL, "%s", test_cases[i]);
+    }
+}
+END_TEST
+
+START_TEST(strict_syntax)
+{
+    static const char *valid = "{\"abc\": [1, 2.5, \"x\\u00A2\", true]}";
+    static const char *extensions[] = { "'abc'", "[1, 'x']", "[%d]", NULL };
+    GVariant *obj;
+    int i;
+
+    obj = g_variant_from_json_full(valid, strlen(valid), G_VARIANT_JSON_STRICT);
+    fail_unless(obj != NULL);
+    g_variant_unref(obj);
+
+    for (i = 0; extensions[i]; i++) {
+        obj = g_variant_from_json_full(extensions[i], strlen(extensions[i]),
+                                       G_VARIANT_JSON_STRICT);
+        fail_unless(obj == NULL, "%s", extensions[i]);
+    }
+
+    /* Escapes are only accepted together with arguments.  */
+    obj = g_variant_from_json("[%d]");
+    fail_unless(obj == NULL);
+}
+END_TEST
+
 START_TEST(unterminated_sq_string)
 {
     GVariant *obj = g_variant_from_json("'abc");
@@ -713,12 +2021,14 @@ static Suite *gvariant_json_suite(void)
 {
     Suite *suite;
     TCase *string_literals, *number_literals, *keyword_literals;
-    TCase *dicts, *lists, *whitespace, *varargs, *errors;
+    TCase *dicts, *lists, *whitespace, *varargs, *streaming, *engines;
+    TCase *errors;
 
     string_literals = tcase_create("String Literals");
     tcase_add_test(string_literals, simple_string);
     tcase_add_test(string_literals, escaped_string);
     tcase_add_test(string_literals, single_quote_string);
+    tcase_add_test(string_literals, long_string);
     tcase_add_test(string_literals, vararg_string);
 
     number_literals = tcase_create("Number Literals");
@@ -738,12 +2048,39 @@ static Suite *gvariant_json_suite(void)
 
     varargs = tcase_create("Varargs");
     tcase_add_test(varargs, simple_varargs);
+    tcase_add_test(varargs, format_template);
+
+    streaming = tcase_create("Streaming");
+    tcase_add_test(streaming, split_feed);
+    tcase_add_test(streaming, message_stream);
+    tcase_add_test(streaming, message_errors);
+    tcase_add_test(streaming, pipeline_order);
+    tcase_add_test(streaming, message_limits);
+    tcase_add_test(streaming, endless_string);
+    tcase_add_test(streaming, split_elements);
+    tcase_add_test(streaming, resync_errors);
+    tcase_add_test(streaming, raw_values);
+    tcase_add_test(streaming, priority_lanes);
+    tcase_add_test(streaming, ndjson_lines);
+    tcase_add_test(streaming, flush_at_end);
+    tcase_add_test(streaming, batch_parse);
+    tcase_add_test(streaming, lazy_position);
+    tcase_add_test(streaming, parallel_feed);
+
+    engines = tcase_create("Engines");
+    tcase_add_test(engines, indexed_parse);
+    tcase_add_test(engines, deep_tape);
+    tcase_add_test(engines, serialized_form);
+    tcase_add_test(engines, typed_parse);
+    tcase_add_test(engines, infer_arrays);
 
     errors = tcase_create("Invalid JSON");
     tcase_add_test(errors, empty_input);
     tcase_add_test(errors, unterminated_string);
     tcase_add_test(errors, unterminated_escape);
     tcase_add_test(errors, unterminated_sq_string);
+    tcase_add_test(errors, invalid_utf8);
+    tcase_add_test(errors, strict_syntax);
     tcase_add_test(errors, unterminated_array);
     tcase_add_test(errors, unterminated_array_comma);
     tcase_add_test(errors, invalid_array_comma);
@@ -763,6 +2100,8 @@ static Suite *gvariant_json_suite(void)
     suite_add_tcase(suite, lists);
     suite_add_tcase(suite, whitespace);
     suite_add_tcase(suite, varargs);
+    suite_add_tcase(suite, streaming);
+    suite_add_tcase(suite, engines);
     suite_add_tcase(suite, errors);
 
     return suite;
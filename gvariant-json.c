@@ -17,39 +17,207 @@
 #include "json-lexer.h"
 #include "json-parser.h"
 #include "json-streamer.h"
+#include "json-index.h"
 #include "gvariant-json.h"
 #include "gvariant-utils.h"
 
 typedef struct JSONParsingState
 {
     JSONMessageParser parser;
-    va_list *ap;
     GVariant *result;
 } JSONParsingState;
 
-static void parse_json(JSONMessageParser *parser, GQueue *tokens)
+static void parse_json(JSONMessageParser *parser, GVariant *value)
 {
     JSONParsingState *s = container_of(parser, JSONParsingState, parser);
-    s->result = json_parser_parse(tokens, s->ap);
+
+    if (s->result) {
+        g_variant_unref(s->result);
+    }
+    s->result = value;
+}
+
+static GVariant *g_variant_from_json_buffer(const char *string, size_t length,
+                                            int lexer_flags, int threads,
+                                            bool infer_arrays, va_list *ap)
+{
+    JSONParsingState state = {};
+
+    /* Nothing here reports positions, so only compute them on errors.  */
+    json_message_parser_init(&state.parser, parse_json, ap,
+                             lexer_flags | JSON_LEXER_LAZY_POSITION);
+    json_lexer_set_threads(&state.parser.lexer, threads);
+    json_parser_set_infer_arrays(&state.parser.parser, infer_arrays);
+    json_message_parser_feed(&state.parser, string, length);
+    json_message_parser_flush(&state.parser);
+    json_message_parser_destroy(&state.parser);
+
+    return state.result;
 }
 
 GVariant *g_variant_from_jsonv(const char *string, va_list *ap)
+{
+    return g_variant_from_json_buffer(string, strlen(string),
+                                      ap ? JSON_LEXER_ESCAPES : 0, 1,
+                                      false, ap);
+}
+
+GVariant *g_variant_from_json(const char *string)
+{
+    return g_variant_from_jsonv(string, NULL);
+}
+
+GVariant *g_variant_from_json_full(const char *string, size_t length,
+                                   GVariantJSONFlags flags)
+{
+    bool infer_arrays = flags & G_VARIANT_JSON_INFER_ARRAYS;
+    GVariant *obj;
+
+    if (flags & G_VARIANT_JSON_INDEXED) {
+        obj = json_index_parse(string, length, infer_arrays);
+        if (obj) {
+            return obj;
+        }
+    }
+
+    return g_variant_from_json_buffer(string, length,
+                                      flags & G_VARIANT_JSON_STRICT
+                                      ? JSON_LEXER_STRICT : 0,
+                                      flags & G_VARIANT_JSON_THREADED
+                                      ? g_get_num_processors() : 1,
+                                      infer_arrays, NULL);
+}
+
+GVariant *g_variant_from_json_typed(const char *string, const char *schema)
 {
     JSONParsingState state = {};
+    JSONSchema *s = json_schema_new(schema);
 
-    state.ap = ap;
+    if (!s) {
+        return NULL;
+    }
 
-    json_message_parser_init(&state.parser, parse_json);
+    json_message_parser_init(&state.parser, parse_json, NULL,
+                             JSON_LEXER_LAZY_POSITION);
+    json_parser_set_schema(&state.parser.parser, s);
     json_message_parser_feed(&state.parser, string, strlen(string));
     json_message_parser_flush(&state.parser);
     json_message_parser_destroy(&state.parser);
+    json_schema_free(s);
 
     return state.result;
 }
 
-GVariant *g_variant_from_json(const char *string)
+typedef struct JSONBatchState
 {
-    return g_variant_from_jsonv(string, NULL);
+    JSONMessageParser parser;
+    GPtrArray *values;
+    GArray *status;
+} JSONBatchState;
+
+static void parse_json_batch(JSONMessageParser *parser, GVariant *value)
+{
+    JSONBatchState *s = container_of(parser, JSONBatchState, parser);
+    GVariantJSONStatus status = value ? G_VARIANT_JSON_OK
+        : parser->at_end ? G_VARIANT_JSON_TRUNCATED
+        : G_VARIANT_JSON_INVALID;
+
+    g_ptr_array_add(s->values, value ? g_variant_ref_sink(value) : NULL);
+    if (s->status) {
+        g_array_append_val(s->status, status);
+    }
+}
+
+static void batch_value_free(gpointer value)
+{
+    if (value) {
+        g_variant_unref(value);
+    }
+}
+
+GPtrArray *g_variant_from_json_batch(const char *const *buffers,
+                                     const size_t *lengths, size_t n_buffers,
+                                     GVariantJSONFlags flags, GArray *status)
+{
+    JSONBatchState state = {};
+    GVariant *result;
+    size_t i;
+
+    state.values = g_ptr_array_new_with_free_func(batch_value_free);
+    state.status = status;
+
+    json_message_parser_init(&state.parser, parse_json_batch, NULL,
+                             (flags & G_VARIANT_JSON_STRICT
+                              ? JSON_LEXER_STRICT : 0) |
+                             JSON_LEXER_LAZY_POSITION);
+    json_lexer_set_threads(&state.parser.lexer,
+                           flags & G_VARIANT_JSON_THREADED
+                           ? g_get_num_processors() : 1);
+    json_message_parser_set_ndjson(&state.parser,
+                                   flags & G_VARIANT_JSON_NDJSON);
+    json_parser_set_infer_arrays(&state.parser.parser,
+                                 flags & G_VARIANT_JSON_INFER_ARRAYS);
+
+    for (i = 0; i < n_buffers; i++) {
+        if (json_message_parser_feed(&state.parser,
+                                     buffers[i], lengths[i]) < 0) {
+            /* There is no telling where the next value starts.  */
+            if (json_parser_end(&state.parser.parser, true, &result)) {
+                parse_json_batch(&state.parser, result);
+            }
+            goto out;
+        }
+    }
+
+    json_message_parser_flush(&state.parser);
+
+out:
+    json_message_parser_destroy(&state.parser);
+    return state.values;
+}
+
+/*
+ * The templates of g_variant_from_jsonf, by the address of the format.
+ * Formats are compiled outside the lock, so that the calls that only
+ * look up their template never wait for one.
+ */
+static GHashTable *jsonf_templates;
+static GRWLock jsonf_lock;
+
+static const JSONTemplate *g_variant_jsonf_template(const char *string)
+{
+    JSONTemplate *template = NULL, *compiled;
+
+    g_rw_lock_reader_lock(&jsonf_lock);
+    if (jsonf_templates) {
+        template = g_hash_table_lookup(jsonf_templates, string);
+    }
+    g_rw_lock_reader_unlock(&jsonf_lock);
+    if (template) {
+        return template;
+    }
+
+    compiled = json_template_new(string);
+    if (!compiled) {
+        return NULL;
+    }
+
+    /* Another thread may have compiled the same format meanwhile.  */
+    g_rw_lock_writer_lock(&jsonf_lock);
+    if (!jsonf_templates) {
+        jsonf_templates = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    template = g_hash_table_lookup(jsonf_templates, string);
+    if (!template) {
+        template = compiled;
+        g_hash_table_insert(jsonf_templates, (gpointer) string, template);
+    }
+    g_rw_lock_writer_unlock(&jsonf_lock);
+
+    if (template != compiled) {
+        json_template_free(compiled);
+    }
+    return template;
 }
 
 /*
@@ -58,11 +226,13 @@ GVariant *g_variant_from_json(const char *string)
  */
 GVariant *g_variant_from_jsonf(const char *string, ...)
 {
+    const JSONTemplate *template = g_variant_jsonf_template(string);
     GVariant *obj;
     va_list ap;
 
+    assert(template != NULL);
     va_start(ap, string);
-    obj = g_variant_from_jsonv(string, &ap);
+    obj = json_template_expand(template, &ap);
     va_end(ap);
 
     assert(obj != NULL);
@@ -132,7 +302,21 @@ static void to_json(GVariant *obj, GString *str, int pretty, int indent)
         ptr = g_variant_get_string(obj, NULL);
         g_string_append_c(str, '\"');
         while (*ptr) {
-            if ((ptr[0] & 0xE0) == 0xE0 &&
+            if ((ptr[0] & 0xF8) == 0xF0 &&
+                (ptr[1] & 0x80) && (ptr[2] & 0x80) && (ptr[3] & 0x80)) {
+                uint32_t wchar;
+
+                wchar  = (ptr[0] & 0x07) << 18;
+                wchar |= (ptr[1] & 0x3F) << 12;
+                wchar |= (ptr[2] & 0x3F) << 6;
+                wchar |= (ptr[3] & 0x3F);
+                wchar -= 0x10000;
+                ptr += 3;
+
+                g_string_append_printf(str, "\\u%04X\\u%04X",
+                                       0xD800 | (wchar >> 10),
+                                       0xDC00 | (wchar & 0x3FF));
+            } else if ((ptr[0] & 0xE0) == 0xE0 &&
                 (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
                 uint16_t wchar;
 
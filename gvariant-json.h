@@ -17,8 +17,61 @@
 #include <stdarg.h>
 #include "gvariant-utils.h"
 
+typedef enum GVariantJSONFlags {
+    /* Parse complete documents with the two-stage structural index.  */
+    G_VARIANT_JSON_INDEXED = 1 << 0,
+
+    /* Reject single-quoted strings and anything else outside RFC 8259.  */
+    G_VARIANT_JSON_STRICT = 1 << 1,
+
+    /* Lex large documents on all processors.  */
+    G_VARIANT_JSON_THREADED = 1 << 2,
+
+    /* For batches: one value per line, and errors do not cross lines.  */
+    G_VARIANT_JSON_NDJSON = 1 << 3,
+
+    /* Parse arrays whose elements share a type as ab, ax, ad, as, aa{sv}.  */
+    G_VARIANT_JSON_INFER_ARRAYS = 1 << 4,
+} GVariantJSONFlags;
+
+typedef enum GVariantJSONStatus {
+    G_VARIANT_JSON_OK,
+    /* The value had a syntax error.  */
+    G_VARIANT_JSON_INVALID,
+    /* The input ended before the value did.  */
+    G_VARIANT_JSON_TRUNCATED,
+} GVariantJSONStatus;
+
 #define GCC_FMT_ATTR(a,b)
 GVariant *g_variant_from_json(const char *string) GCC_FMT_ATTR(1, 0);
+GVariant *g_variant_from_json_full(const char *string, size_t length,
+                                   GVariantJSONFlags flags);
+
+/*
+ * Parse all the values in N_BUFFERS buffers, which are consecutive parts
+ * of the same input, with a single parser.  Return an array with a
+ * reference to each value, or NULL for one that could not be parsed.
+ * If STATUS is not NULL, a GVariantJSONStatus is appended to it for
+ * each element of the result.  Without G_VARIANT_JSON_NDJSON, parsing
+ * stops at the first lexical error.
+ */
+GPtrArray *g_variant_from_json_batch(const char *const *buffers,
+                                     const size_t *lengths, size_t n_buffers,
+                                     GVariantJSONFlags flags, GArray *status);
+
+/*
+ * Parse STRING into a value of the type of SCHEMA instead of a{sv} and
+ * av.  SCHEMA is a GVariant type string, where tuples can name their
+ * members as in "(name:s id:x tags:as)" to be filled from an object;
+ * see json-schema.h.  Return NULL if the value does not fit SCHEMA or
+ * SCHEMA is not valid.
+ */
+GVariant *g_variant_from_json_typed(const char *string, const char *schema);
+
+/*
+ * STRING is compiled on the first call and looked up by its address
+ * afterwards, so it must not change; normally it is a string literal.
+ */
 GVariant *g_variant_from_jsonf(const char *string, ...) GCC_FMT_ATTR(1, 2);
 GVariant *g_variant_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 
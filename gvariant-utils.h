@@ -20,15 +20,24 @@
 #include <assert.h>
 #include <glib.h>
 
+/* The elements of an av are unboxed; other arrays are passed as is.  */
 static inline void g_variant_array_iterate(GVariant *array,
                  void (*iter)(GVariant *obj, void *opaque), void *opaque)
 {
-    GVariant *var;
+    GVariant *elem, *var;
     GVariantIter _iter;
 
     g_variant_iter_init(&_iter, array);
-    while (g_variant_iter_loop (&_iter, "v", &var))
-      iter (var, opaque);
+    while ((elem = g_variant_iter_next_value (&_iter))) {
+      if (g_variant_is_of_type (elem, G_VARIANT_TYPE_VARIANT)) {
+        var = g_variant_get_variant (elem);
+        iter (var, opaque);
+        g_variant_unref (var);
+      } else {
+        iter (elem, opaque);
+      }
+      g_variant_unref (elem);
+    }
 }
 
 #if GLIB_MAJOR_VERSION == 2 && GLIB_MINOR_VERSION <= 26
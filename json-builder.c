@@ -0,0 +1,439 @@
+/*
+ * Serialized GVariant builder for JSON values
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * The data follows the GVariant serialization format.  An av is its
+ * variants, each aligned to 8 bytes, followed by the end offset of each
+ * one; a variant is the data of its child, a zero byte and the type
+ * string of the child.  An a{sv} is the same with dictionary entries,
+ * which are the key and its zero byte, the variant aligned to 8 bytes,
+ * and the end offset of the key.  Offsets are little endian and as wide
+ * as needed to address the container that holds them.
+ *
+ * Each container is aligned to 8 bytes in the buffer, so the alignment
+ * of its elements can be computed from the start of the buffer.  The
+ * end offsets of the elements are only written once the container is
+ * closed, because their width depends on its final size.
+ *
+ * When arrays are inferred, an array whose variants all hold the same
+ * type is rewritten in place once it is closed: each child moves down
+ * over the padding and type string of the variants before it.
+ *
+ * GLib does not read serialized data more than 128 levels deep, and
+ * each JSON container takes two or three levels.  When a value goes
+ * deeper than JSON_BUILDER_MAX_DEPTH containers, each element that is
+ * complete becomes a GVariant of its own, pointing into the data, and
+ * the rest of the value is collected in a GPtrArray per container.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "json-builder.h"
+
+typedef struct JSONBuilderFrame
+{
+    /* The start of the data of the container.  */
+    size_t start;
+    /* The dictionary entry that holds it, and the end of its key.  */
+    size_t entry;
+    size_t key_end;
+    /* Index in the offsets array of its first element.  */
+    guint first;
+    /* The type of the elements of an array, if they all have the same.  */
+    size_t elem_type;
+    size_t elem_type_len;
+    bool mixed;
+    char c;
+    /* In the tree, the elements and the key of the container.  */
+    GPtrArray *values;
+    GVariant *key;
+} JSONBuilderFrame;
+
+#define JSON_BUILDER_MAX_DEPTH 32
+
+void json_builder_init(JSONBuilder *builder)
+{
+    builder->data = NULL;
+    builder->frames = g_array_new(FALSE, FALSE, sizeof(JSONBuilderFrame));
+    builder->offsets = g_array_new(FALSE, FALSE, sizeof(size_t));
+    builder->in_tree = FALSE;
+    builder->infer_arrays = FALSE;
+}
+
+void json_builder_set_infer_arrays(JSONBuilder *builder, gboolean infer)
+{
+    builder->infer_arrays = infer;
+}
+
+static JSONBuilderFrame *json_builder_top(JSONBuilder *builder)
+{
+    return &g_array_index(builder->frames, JSONBuilderFrame,
+                          builder->frames->len - 1);
+}
+
+/* Whether arrays of TYPE, of LEN bytes, replace av.  */
+static bool json_builder_infers(const char *type, size_t len)
+{
+    if (len == 1) {
+        return strchr("bxds", type[0]) != NULL;
+    }
+    return len == 5 && !memcmp(type, "a{sv}", 5);
+}
+
+static guint8 *json_builder_grow(JSONBuilder *builder, size_t len)
+{
+    size_t old = builder->data->len;
+
+    g_byte_array_set_size(builder->data, old + len);
+    return builder->data->data + old;
+}
+
+/* Pad with zeros to the alignment of variants and dictionary entries.  */
+static void json_builder_align(JSONBuilder *builder)
+{
+    size_t pad = -builder->data->len & 7;
+
+    if (pad) {
+        memset(json_builder_grow(builder, pad), 0, pad);
+    }
+}
+
+/* Return the width of the N offsets of a container with BODY bytes.  */
+static size_t json_builder_offset_size(size_t body, size_t n)
+{
+    if (body + n <= G_MAXUINT8) {
+        return 1;
+    }
+    if (body + 2 * n <= G_MAXUINT16) {
+        return 2;
+    }
+    if (body + 4 * n <= G_MAXUINT32) {
+        return 4;
+    }
+    return 8;
+}
+
+static void json_builder_write_offset(guint8 *p, size_t offset, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        p[i] = offset >> (i * 8);
+    }
+}
+
+/*
+ * Start an element of the innermost container, and return where its
+ * dictionary entry starts and where the key ends if it has KEY.
+ */
+static void json_builder_begin(JSONBuilder *builder, GVariant *key,
+                               size_t *entry, size_t *key_end)
+{
+    const char *str;
+    gsize len;
+
+    json_builder_align(builder);
+    *entry = builder->data->len;
+    *key_end = 0;
+    if (key) {
+        str = g_variant_get_string(key, &len);
+        memcpy(json_builder_grow(builder, len + 1), str, len + 1);
+        *key_end = len + 1;
+        g_variant_unref(g_variant_ref_sink(key));
+        json_builder_align(builder);
+    }
+}
+
+/*
+ * Finish an element whose child, of type TYPE, was just written: close
+ * the variant and the dictionary entry, and remember where it ends.
+ */
+static void json_builder_end(JSONBuilder *builder, const char *type,
+                             size_t entry, size_t key_end)
+{
+    JSONBuilderFrame *parent = json_builder_top(builder);
+    size_t len = strlen(type), size, end;
+    guint8 *p;
+
+    p = json_builder_grow(builder, len + 1);
+    p[0] = 0;
+    memcpy(p + 1, type, len);
+    if (builder->infer_arrays && parent->c == '[' && !parent->mixed) {
+        if (!parent->elem_type_len) {
+            parent->elem_type = p + 1 - builder->data->data;
+            parent->elem_type_len = len;
+        } else if (parent->elem_type_len != len ||
+                   memcmp(builder->data->data + parent->elem_type,
+                          type, len)) {
+            parent->mixed = true;
+        }
+    }
+    if (key_end) {
+        size = json_builder_offset_size(builder->data->len - entry, 1);
+        json_builder_write_offset(json_builder_grow(builder, size),
+                                  key_end, size);
+    }
+    end = builder->data->len - parent->start;
+    g_array_append_val(builder->offsets, end);
+}
+
+/*
+ * Turn the N variants of the array in FRAME, which all hold a value
+ * of type TYPE, into the elements of an array of TYPE.  Return the
+ * new size of its data, and leave the new end of each element in the
+ * offsets array.
+ */
+static size_t json_builder_unbox(JSONBuilder *builder,
+                                 JSONBuilderFrame *frame, size_t n,
+                                 const char *type, size_t len)
+{
+    guint8 *base = builder->data->data + frame->start;
+    size_t *ends = &g_array_index(builder->offsets, size_t, frame->first);
+    size_t align = strchr("xda", type[0]) ? 8 : 1;
+    size_t src = 0, dst = 0, pad, size, i;
+
+    for (i = 0; i < n; i++) {
+        size = ends[i] - src - len - 1;
+        pad = -dst & (align - 1);
+        memset(base + dst, 0, pad);
+        dst += pad;
+        memmove(base + dst, base + src, size);
+        dst += size;
+        src = (ends[i] + 7) & ~(size_t) 7;
+        ends[i] = dst;
+    }
+    return dst;
+}
+
+/* Add VALUE to the innermost container of the tree.  */
+static void json_builder_tree_add(JSONBuilder *builder, GVariant *key,
+                                  GVariant *value)
+{
+    JSONBuilderFrame *frame = json_builder_top(builder);
+
+    value = g_variant_new_variant(value);
+    if (key) {
+        value = g_variant_new_dict_entry(key, value);
+    }
+    g_ptr_array_add(frame->values, g_variant_ref_sink(value));
+}
+
+/* Build the container of FRAME, in the tree.  */
+static GVariant *json_builder_tree_end(JSONBuilder *builder,
+                                       JSONBuilderFrame *frame)
+{
+    GVariant **children = (GVariant **) frame->values->pdata, **unboxed;
+    GVariant *value = NULL;
+    const char *type;
+    guint i, n = frame->values->len;
+
+    if (frame->c == '{') {
+        return g_variant_new_array(G_VARIANT_TYPE("{sv}"), children, n);
+    }
+
+    if (builder->infer_arrays && n) {
+        unboxed = g_new(GVariant *, n);
+        for (i = 0; i < n; i++) {
+            unboxed[i] = g_variant_get_variant(children[i]);
+        }
+        type = g_variant_get_type_string(unboxed[0]);
+        for (i = 1; i < n; i++) {
+            if (strcmp(g_variant_get_type_string(unboxed[i]), type)) {
+                break;
+            }
+        }
+        if (i == n && json_builder_infers(type, strlen(type))) {
+            value = g_variant_new_array(NULL, unboxed, n);
+        }
+        for (i = 0; i < n; i++) {
+            g_variant_unref(unboxed[i]);
+        }
+        g_free(unboxed);
+        if (value) {
+            return value;
+        }
+    }
+    return g_variant_new_array(G_VARIANT_TYPE_VARIANT, children, n);
+}
+
+static GPtrArray *json_builder_new_values(void)
+{
+    return g_ptr_array_new_with_free_func((GDestroyNotify) g_variant_unref);
+}
+
+/* Move the open containers and their complete elements to the tree.  */
+static void json_builder_to_tree(JSONBuilder *builder)
+{
+    GBytes *bytes = g_byte_array_free_to_bytes(builder->data), *slice;
+    const char *data = g_bytes_get_data(bytes, NULL);
+    const GVariantType *type;
+    JSONBuilderFrame *frame;
+    size_t start, end;
+    guint i, j, last;
+
+    for (i = 0; i < builder->frames->len; i++) {
+        frame = &g_array_index(builder->frames, JSONBuilderFrame, i);
+        frame->values = json_builder_new_values();
+        if (i && frame[-1].c == '{') {
+            frame->key = g_variant_ref_sink(
+                g_variant_new_string(data + frame->entry));
+        }
+
+        type = (frame->c == '{') ? G_VARIANT_TYPE("{sv}")
+                                 : G_VARIANT_TYPE_VARIANT;
+        last = (i + 1 < builder->frames->len) ? frame[1].first
+                                              : builder->offsets->len;
+        start = 0;
+        for (j = frame->first; j < last; j++) {
+            end = g_array_index(builder->offsets, size_t, j);
+            slice = g_bytes_new_from_bytes(bytes, frame->start + start,
+                                           end - start);
+            g_ptr_array_add(frame->values, g_variant_ref_sink(
+                g_variant_new_from_bytes(type, slice, TRUE)));
+            g_bytes_unref(slice);
+            start = (end + 7) & ~(size_t) 7;
+        }
+    }
+    g_bytes_unref(bytes);
+    builder->data = NULL;
+    g_array_set_size(builder->offsets, 0);
+    builder->in_tree = TRUE;
+}
+
+void json_builder_open(JSONBuilder *builder, GVariant *key, char c)
+{
+    JSONBuilderFrame frame = { .c = c };
+
+    if (!builder->in_tree &&
+        builder->frames->len == JSON_BUILDER_MAX_DEPTH) {
+        json_builder_to_tree(builder);
+    }
+    if (builder->in_tree) {
+        frame.values = json_builder_new_values();
+        frame.key = key ? g_variant_ref_sink(key) : NULL;
+    } else if (!builder->frames->len) {
+        builder->data = g_byte_array_new();
+    } else {
+        json_builder_begin(builder, key, &frame.entry, &frame.key_end);
+    }
+    if (!builder->in_tree) {
+        frame.start = builder->data->len;
+        frame.first = builder->offsets->len;
+    }
+    g_array_append_val(builder->frames, frame);
+}
+
+void json_builder_add(JSONBuilder *builder, GVariant *key, GVariant *value)
+{
+    size_t entry, key_end, size;
+
+    if (builder->in_tree) {
+        json_builder_tree_add(builder, key, value);
+        return;
+    }
+
+    g_variant_ref_sink(value);
+    json_builder_begin(builder, key, &entry, &key_end);
+    size = g_variant_get_size(value);
+    g_variant_store(value, json_builder_grow(builder, size));
+    json_builder_end(builder, g_variant_get_type_string(value),
+                     entry, key_end);
+    g_variant_unref(value);
+}
+
+GVariant *json_builder_close(JSONBuilder *builder)
+{
+    JSONBuilderFrame frame = *json_builder_top(builder);
+    size_t n = builder->offsets->len - frame.first, size = 0, i;
+    char type[8] = "av";
+    bool fixed = false;
+    GVariant *value;
+    GBytes *bytes;
+    guint8 *p;
+
+    if (builder->in_tree) {
+        value = json_builder_tree_end(builder, &frame);
+        g_ptr_array_free(frame.values, TRUE);
+        g_array_set_size(builder->frames, builder->frames->len - 1);
+        if (!builder->frames->len) {
+            builder->in_tree = FALSE;
+            return value;
+        }
+        json_builder_tree_add(builder, frame.key, value);
+        if (frame.key) {
+            g_variant_unref(frame.key);
+        }
+        return NULL;
+    }
+
+    if (frame.c == '{') {
+        strcpy(type, "a{sv}");
+    } else if (n && !frame.mixed && frame.elem_type_len &&
+               json_builder_infers((char *) builder->data->data +
+                                   frame.elem_type, frame.elem_type_len)) {
+        memcpy(type + 1, builder->data->data + frame.elem_type,
+               frame.elem_type_len);
+        type[frame.elem_type_len + 1] = 0;
+        size = json_builder_unbox(builder, &frame, n, type + 1,
+                                  frame.elem_type_len);
+        g_byte_array_set_size(builder->data, frame.start + size);
+        fixed = strchr("bxd", type[1]) != NULL;
+    }
+
+    if (n && !fixed) {
+        size = json_builder_offset_size(builder->data->len - frame.start, n);
+        p = json_builder_grow(builder, n * size);
+        for (i = 0; i < n; i++, p += size) {
+            json_builder_write_offset(p, g_array_index(builder->offsets,
+                                                       size_t,
+                                                       frame.first + i),
+                                      size);
+        }
+    }
+    g_array_set_size(builder->offsets, frame.first);
+    g_array_set_size(builder->frames, builder->frames->len - 1);
+    if (builder->frames->len) {
+        json_builder_end(builder, type, frame.entry, frame.key_end);
+        return NULL;
+    }
+
+    /* The data is in normal form, so GLib need not check it.  */
+    bytes = g_byte_array_free_to_bytes(builder->data);
+    builder->data = NULL;
+    value = g_variant_new_from_bytes(G_VARIANT_TYPE(type), bytes, TRUE);
+    g_bytes_unref(bytes);
+    return value;
+}
+
+void json_builder_clear(JSONBuilder *builder)
+{
+    JSONBuilderFrame *frame;
+    guint i;
+
+    for (i = 0; i < builder->frames->len; i++) {
+        frame = &g_array_index(builder->frames, JSONBuilderFrame, i);
+        if (frame->values) {
+            g_ptr_array_free(frame->values, TRUE);
+        }
+        if (frame->key) {
+            g_variant_unref(frame->key);
+        }
+    }
+    builder->in_tree = FALSE;
+    if (builder->data) {
+        g_byte_array_unref(builder->data);
+        builder->data = NULL;
+    }
+    g_array_set_size(builder->frames, 0);
+    g_array_set_size(builder->offsets, 0);
+}
+
+void json_builder_destroy(JSONBuilder *builder)
+{
+    json_builder_clear(builder);
+    g_array_free(builder->frames, TRUE);
+    g_array_free(builder->offsets, TRUE);
+}
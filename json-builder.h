@@ -0,0 +1,66 @@
+/*
+ * Serialized GVariant builder for JSON values
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_JSON_BUILDER_H
+#define QEMU_JSON_BUILDER_H
+
+#include <glib.h>
+#include <stddef.h>
+
+/*
+ * Builds the a{sv} and av containers of a JSON value.  Unlike
+ * GVariantBuilder, which serializes every container again when its
+ * parent is built, the data is written once, in normal form, into a
+ * single buffer that becomes the value.  Values nested too deeply for
+ * GLib to read back from serialized data are built as a tree of
+ * GVariants instead.
+ */
+typedef struct JSONBuilder
+{
+    GByteArray *data;
+    /* The open containers, outermost first.  */
+    GArray *frames;
+    /* End of each element of the open containers, from their start.  */
+    GArray *offsets;
+    gboolean in_tree;
+    gboolean infer_arrays;
+} JSONBuilder;
+
+void json_builder_init(JSONBuilder *builder);
+
+/*
+ * Build arrays whose elements are all b, x, d, s or a{sv} as ab, ax,
+ * ad, as or aa{sv} instead of av.  Empty and mixed arrays stay av.
+ */
+void json_builder_set_infer_arrays(JSONBuilder *builder, gboolean infer);
+
+/*
+ * Open a container, '{' or '['.  KEY is its key if the innermost
+ * container is an object, NULL otherwise; it is consumed as below.
+ */
+void json_builder_open(JSONBuilder *builder, GVariant *key, char c);
+
+/*
+ * Add VALUE to the innermost container, with KEY if it is an object.
+ * Floating references to KEY and VALUE are consumed, as with
+ * g_variant_builder_add_value.
+ */
+void json_builder_add(JSONBuilder *builder, GVariant *key, GVariant *value);
+
+/*
+ * Close the innermost container.  Return the outermost one when it
+ * is closed, NULL otherwise.
+ */
+GVariant *json_builder_close(JSONBuilder *builder);
+
+/* Drop the containers that are open, if any.  */
+void json_builder_clear(JSONBuilder *builder);
+
+void json_builder_destroy(JSONBuilder *builder);
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ * JSON structural index
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "json-builder.h"
+#include "json-index.h"
+#include "json-lexer.h"
+#include "json-parser.h"
+#include "json-utf8.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Stage one
+ *
+ * The buffer is processed 64 bytes at a time.  Each block is classified
+ * into bitmaps, one bit per byte, and the bitmaps are combined to find
+ * which bytes are inside strings.  The result is the offset of every
+ * byte that starts a value or is an operator outside strings.
+ */
+typedef struct JSONBlock
+{
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+    uint64_t ws;
+} JSONBlock;
+
+typedef struct JSONIndexState
+{
+    uint64_t prev_escaped;
+    uint64_t prev_in_string;
+    uint64_t prev_scalar;
+} JSONIndexState;
+
+static void json_index_classify(const uint8_t *p, JSONBlock *b)
+{
+#if defined(__AVX2__)
+    int k;
+
+    memset(b, 0, sizeof(*b));
+    for (k = 0; k < 64; k += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + k));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i op, ws;
+
+        /* '[' and ']' are '{' and '}' without bit 5.  */
+        op = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')),
+                            _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':'))));
+        ws = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+
+        b->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << k;
+        b->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << k;
+        b->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << k;
+        b->ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << k;
+    }
+#elif defined(__SSE2__)
+    int k;
+
+    memset(b, 0, sizeof(*b));
+    for (k = 0; k < 64; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i op, ws;
+
+        /* '[' and ']' are '{' and '}' without bit 5.  */
+        op = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                         _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(':'))));
+        ws = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+
+        b->quote |= (uint64_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << k;
+        b->backslash |= (uint64_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << k;
+        b->op |= (uint64_t)_mm_movemask_epi8(op) << k;
+        b->ws |= (uint64_t)_mm_movemask_epi8(ws) << k;
+    }
+#else
+    int k;
+
+    memset(b, 0, sizeof(*b));
+    for (k = 0; k < 64; k++) {
+        uint64_t bit = 1ULL << k;
+
+        switch (p[k]) {
+        case '"':
+            b->quote |= bit;
+            break;
+        case '\\':
+            b->backslash |= bit;
+            break;
+        case '{': case '}': case '[': case ']': case ',': case ':':
+            b->op |= bit;
+            break;
+        case ' ': case '\t': case '\n': case '\r':
+            b->ws |= bit;
+            break;
+        }
+    }
+#endif
+}
+
+/*
+ * Return a mask of the bytes that are escaped by a backslash, i.e. that
+ * follow an odd-length run of backslashes.  Runs can continue from the
+ * previous block, which is tracked in *PREV_ESCAPED.
+ */
+static uint64_t json_index_find_escaped(uint64_t backslash,
+                                        uint64_t *prev_escaped)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    uint64_t follows_escape, odd_starts, even_ends, invert;
+
+    backslash &= ~*prev_escaped;
+    follows_escape = (backslash << 1) | *prev_escaped;
+
+    /* A run that starts on an odd bit and ends on an even one has odd
+       length; the carry of the addition tells where each run ends.  */
+    odd_starts = backslash & ~even_bits & ~follows_escape;
+    *prev_escaped = __builtin_add_overflow(odd_starts, backslash, &even_ends);
+    invert = even_ends << 1;
+    return (even_bits ^ invert) & follows_escape;
+}
+
+/* Bit N of the result is the XOR of bits 0 to N of X.  */
+static inline uint64_t json_index_prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static uint64_t json_index_block(JSONIndexState *s, const uint8_t *p)
+{
+    JSONBlock b;
+    uint64_t escaped, quote, in_string, scalar, scalar_start;
+
+    json_index_classify(p, &b);
+    escaped = json_index_find_escaped(b.backslash, &s->prev_escaped);
+    quote = b.quote & ~escaped;
+
+    /* IN_STRING includes the opening quote but not the closing one.  */
+    in_string = json_index_prefix_xor(quote) ^ s->prev_in_string;
+    s->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+    /* Numbers and keywords are indexed by their first byte.  */
+    scalar = ~(b.op | b.ws | b.quote);
+    scalar_start = scalar & ~((scalar << 1) | s->prev_scalar);
+    s->prev_scalar = scalar >> 63;
+
+    return ((b.op | scalar_start) & ~in_string) | (quote & in_string);
+}
+
+static bool json_index_build(const char *buffer, size_t size, GArray *index)
+{
+    JSONIndexState s = {};
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += 64) {
+        const uint8_t *p = (const uint8_t *)buffer + offset;
+        uint8_t tail[64];
+        uint64_t structural;
+
+        if (size - offset < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p, size - offset);
+            p = tail;
+        }
+
+        structural = json_index_block(&s, p);
+        while (structural) {
+            uint32_t pos = offset + __builtin_ctzll(structural);
+            g_array_append_val(index, pos);
+            structural &= structural - 1;
+        }
+    }
+
+    /* Fail on unterminated strings.  */
+    return !s.prev_in_string;
+}
+
+/*
+ * Stage two
+ *
+ * Scalars are delimited and validated here with the same rules as
+ * json-lexer.c, so that they can be converted by json-parser.c.
+ */
+static bool json_index_is_hex(char ch)
+{
+    return g_ascii_isxdigit(ch);
+}
+
+static size_t json_index_string_len(const char *p, const char *end)
+{
+    const char *start = p++;
+
+    while (p < end) {
+        switch (*p) {
+        case '"':
+            return p + 1 - start;
+        case 0:
+            return 0;
+        case '\\':
+            if (++p == end) {
+                return 0;
+            }
+            switch (*p) {
+            case 'b': case 'f': case 'n': case 'r': case 't':
+            case '/': case '\\': case '\'': case '"':
+                break;
+            case 'u':
+                if (end - p <= 4 ||
+                    !json_index_is_hex(p[1]) || !json_index_is_hex(p[2]) ||
+                    !json_index_is_hex(p[3]) || !json_index_is_hex(p[4])) {
+                    return 0;
+                }
+                p += 4;
+                break;
+            default:
+                return 0;
+            }
+            break;
+        }
+        p++;
+    }
+    return 0;
+}
+
+static const char *json_index_digits(const char *p, const char *end)
+{
+    while (p < end && g_ascii_isdigit(*p)) {
+        p++;
+    }
+    return p;
+}
+
+/* Return the type of the number in [P, END), or ERROR if it is invalid.  */
+static int json_index_number_type(const char *p, const char *end)
+{
+    int type = JSON_INTEGER;
+    bool zero;
+
+    if (p < end && *p == '-') {
+        p++;
+    }
+    if (p == end || !g_ascii_isdigit(*p)) {
+        return 0;
+    }
+    zero = (*p == '0');
+    p = zero ? p + 1 : json_index_digits(p, end);
+
+    if (p < end && *p == '.') {
+        const char *digits = ++p;
+        p = json_index_digits(p, end);
+        if (p == digits) {
+            return 0;
+        }
+        zero = false;
+        type = JSON_FLOAT;
+    }
+    /* Like the lexer, do not accept an exponent right after a zero.  */
+    if (p < end && (*p == 'e' || *p == 'E') && !zero) {
+        const char *digits;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            p++;
+        }
+        digits = p;
+        p = json_index_digits(p, end);
+        if (p == digits) {
+            return 0;
+        }
+        type = JSON_FLOAT;
+    }
+    return p == end ? type : 0;
+}
+
+static GVariant *json_index_scalar(const char *p, const char *end)
+{
+    JSONToken token;
+    const char *q;
+
+    if (*p == '"') {
+        token.type = JSON_STRING;
+        token.len = json_index_string_len(p, end);
+        if (!token.len) {
+            return NULL;
+        }
+    } else {
+        for (q = p; q < end; q++) {
+            if (*q == ' ' || *q == '\t' || *q == '\n' || *q == '\r' ||
+                *q == ',' || *q == ':' || *q == '"' ||
+                *q == '{' || *q == '}' || *q == '[' || *q == ']') {
+                break;
+            }
+        }
+        token.len = q - p;
+        if (token.len == 4 && !memcmp(p, "true", 4)) {
+            return g_variant_new_boolean(TRUE);
+        }
+        if (token.len == 5 && !memcmp(p, "false", 5)) {
+            return g_variant_new_boolean(FALSE);
+        }
+        token.type = json_index_number_type(p, q);
+        if (!token.type) {
+            return NULL;
+        }
+    }
+
+    token.str = p;
+    token.value = token.type == JSON_INTEGER
+        ? json_lexer_integer_value(p, token.len) : 0;
+    token.x = token.y = 0;
+    return json_parser_parse_literal(&token);
+}
+
+static GVariant *json_index_walk(const char *buffer, size_t size,
+                                 const uint32_t *index, size_t n,
+                                 bool infer_arrays)
+{
+    const char *end = buffer + size;
+    JSONBuilder builder;
+    GString *stack;
+    GVariant *key = NULL, *value, *result = NULL;
+    size_t i = 0;
+    char c, top;
+
+    json_builder_init(&builder);
+    json_builder_set_infer_arrays(&builder, infer_arrays);
+    stack = g_string_new(NULL);
+    for (;;) {
+        /* Parse a value, and the key before it if inside an object.  */
+        if (stack->len && stack->str[stack->len - 1] == '{') {
+            if (i + 1 >= n || buffer[index[i]] != '"' ||
+                buffer[index[i + 1]] != ':') {
+                goto out;
+            }
+            key = json_index_scalar(buffer + index[i], end);
+            if (!key) {
+                goto out;
+            }
+            i += 2;
+        }
+
+        if (i >= n) {
+            goto out;
+        }
+        c = buffer[index[i]];
+        if (c == '{' || c == '[') {
+            json_builder_open(&builder, key, c);
+            key = NULL;
+            g_string_append_c(stack, c);
+            i++;
+            if (i < n && buffer[index[i]] == c + 2) {
+                goto close;
+            }
+            continue;
+        }
+
+        value = json_index_scalar(buffer + index[i], end);
+        if (!value) {
+            goto out;
+        }
+        i++;
+        if (!stack->len) {
+            result = value;
+            break;
+        }
+        json_builder_add(&builder, key, value);
+        key = NULL;
+
+        /* Find the next value, closing containers as needed.  */
+        for (;;) {
+            if (i >= n) {
+                goto out;
+            }
+            top = stack->str[stack->len - 1];
+            c = buffer[index[i]];
+            if (c == ',') {
+                i++;
+                break;
+            }
+            if (c != top + 2) {
+                goto out;
+            }
+        close:
+            i++;
+            g_string_truncate(stack, stack->len - 1);
+            result = json_builder_close(&builder);
+            if (result) {
+                goto done;
+            }
+        }
+    }
+
+done:
+    /* Anything after the value, even another value, is left to the
+       streaming parser.  */
+    if (i < n) {
+        g_variant_unref(g_variant_ref_sink(result));
+        result = NULL;
+    }
+    json_builder_destroy(&builder);
+    g_string_free(stack, TRUE);
+    return result;
+
+out:
+    if (key) {
+        g_variant_unref(key);
+    }
+    json_builder_destroy(&builder);
+    g_string_free(stack, TRUE);
+    return NULL;
+}
+
+GVariant *json_index_parse(const char *buffer, size_t size,
+                           bool infer_arrays)
+{
+    GVariant *result = NULL;
+    JSONUTF8State utf8;
+    GArray *index;
+
+    if (size >= UINT32_MAX) {
+        return NULL;
+    }
+
+    /* Strings are created as trusted GVariants, like json-parser.c does.  */
+    json_utf8_init(&utf8);
+    if (json_utf8_validate(&utf8, buffer, size) < size ||
+        !json_utf8_complete(&utf8)) {
+        return NULL;
+    }
+
+    index = g_array_sized_new(FALSE, FALSE, sizeof(uint32_t), size / 8 + 1);
+    if (json_index_build(buffer, size, index)) {
+        result = json_index_walk(buffer, size,
+                                 &g_array_index(index, uint32_t, 0),
+                                 index->len, infer_arrays);
+    }
+    g_array_free(index, TRUE);
+    return result;
+}
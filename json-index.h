@@ -0,0 +1,28 @@
+/*
+ * JSON structural index
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_JSON_INDEX_H
+#define QEMU_JSON_INDEX_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Parse a complete document in two passes: first find the offsets of
+ * all structural characters, then walk them to build the GVariant.
+ *
+ * Only the subset of the syntax that is valid JSON is supported.  NULL
+ * is returned for anything else, including single-quoted strings, escapes
+ * and syntax errors; the caller should then fall back to the streaming
+ * parser, which produces the same result for all valid input.
+ */
+GVariant *json_index_parse(const char *buffer, size_t size,
+                           bool infer_arrays);
+
+#endif
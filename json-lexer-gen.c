@@ -0,0 +1,131 @@
+/*
+ * Generate the compressed JSON lexer tables
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * The DFA in json-lexer-dfa.h has 256 columns per state, but most bytes
+ * behave the same in every state.  Bytes whose columns are identical are
+ * merged into a single class, so that the transition table is indexed by
+ * class and fits in a few cache lines.  Each transition also records
+ * whether it needed lookahead, so that the lexer does not have to look
+ * at the table a second time.
+ *
+ * One table is written for each variant of the lexer.  A variant only
+ * keeps the first states of the DFA; transitions to the others become
+ * errors, which in turn lets more bytes share a class.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_LEXER_GEN
+#include "json-lexer-dfa.h"
+
+#define N_STATES (sizeof(json_lexer) / sizeof(json_lexer[0]))
+#define LOOKAHEAD 0x80
+
+static const struct {
+    const char *name;
+    unsigned n_states;
+} variants[] = {
+    { "strict", JSON_LEXER_STRICT_STATES },
+    { "default", JSON_LEXER_DEFAULT_STATES },
+    { "escapes", JSON_LEXER_ESCAPES_STATES },
+};
+
+static unsigned n_states;
+static int byte_class[256];
+static int class_rep[256];
+static int n_classes;
+
+static int next_state(unsigned s, int ch)
+{
+    int next = json_lexer[s][ch];
+
+    if (next < JSON_OPERATOR && next >= n_states) {
+        return ERROR;
+    }
+    return next;
+}
+
+static int same_column(int a, int b)
+{
+    unsigned s;
+
+    for (s = 0; s < n_states; s++) {
+        if (next_state(s, a) != next_state(s, b)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void compute_classes(void)
+{
+    int ch, c;
+
+    n_classes = 0;
+    for (ch = 0; ch < 256; ch++) {
+        for (c = 0; c < n_classes; c++) {
+            if (same_column(ch, class_rep[c])) {
+                break;
+            }
+        }
+        if (c == n_classes) {
+            class_rep[n_classes++] = ch;
+        }
+        byte_class[ch] = c;
+    }
+}
+
+static void print_variant(const char *name)
+{
+    unsigned s;
+    int ch, c;
+
+    compute_classes();
+
+    printf("static const uint8_t json_lexer_class_%s[256] = {", name);
+    for (ch = 0; ch < 256; ch++) {
+        printf("%s%2d,", ch % 16 ? " " : "\n    ", byte_class[ch]);
+    }
+    printf("\n};\n\n");
+
+    printf("static const uint8_t json_lexer_next_%s[%u][%d] = {\n",
+           name, n_states, n_classes);
+    for (s = 0; s < n_states; s++) {
+        printf("    [%u] = {", s);
+        for (c = 0; c < n_classes; c++) {
+            int next = next_state(s, class_rep[c]);
+
+            if (next != ERROR && TERMINAL_NEEDED_LOOKAHEAD(s, next)) {
+                next |= LOOKAHEAD;
+            }
+            printf("%s0x%02x,", c % 12 ? " " : "\n        ", next);
+        }
+        printf("\n    },\n");
+    }
+    printf("};\n\n");
+}
+
+int main(void)
+{
+    unsigned i;
+
+    printf("/* Generated by json-lexer-gen from json-lexer-dfa.h, do not edit.  */\n\n");
+    printf("#define JSON_LEXER_LOOKAHEAD 0x%x\n\n", LOOKAHEAD);
+
+    for (i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        n_states = variants[i].n_states;
+        if (n_states > N_STATES || n_states > LOOKAHEAD) {
+            fprintf(stderr, "invalid number of states for %s\n",
+                    variants[i].name);
+            return EXIT_FAILURE;
+        }
+        print_variant(variants[i].name);
+    }
+
+    return ferror(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
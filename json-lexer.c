@@ -14,278 +14,164 @@
  */
 
 #include "json-lexer.h"
+#include <stdbool.h>
 #include <stdint.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "json-lexer-dfa.h"
+#include "json-lexer-classes.h"
+
 /*
- * \"([^\\\"]|(\\\"\\'\\\\\\/\\b\\f\\n\\r\\t\\u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F]))*\"
- * '([^\\']|(\\\"\\'\\\\\\/\\b\\f\\n\\r\\t\\u[0-9a-fA-F][0-9a-fA-F][0-9a-fA-F][0-9a-fA-F]))*'
- * 0|([1-9][0-9]*(.[0-9]+)?([eE]([-+])?[0-9]+))
- * [{}\[\],:]
- * [a-z]+
- *
+ * Integers are accumulated as an absolute value while the digits go
+ * through the DFA.  The absolute value saturates just above INT64_MAX,
+ * so that both INT64_MIN and overflow can be told apart at the end.
  */
+#define JSON_LEXER_MAX_MAGNITUDE ((uint64_t)INT64_MAX + 1)
 
-enum json_lexer_state {
-    ERROR = 0,
-    IN_DQ_UCODE3,
-    IN_DQ_UCODE2,
-    IN_DQ_UCODE1,
-    IN_DQ_UCODE0,
-    IN_DQ_STRING_ESCAPE,
-    IN_DQ_STRING,
-    IN_SQ_UCODE3,
-    IN_SQ_UCODE2,
-    IN_SQ_UCODE1,
-    IN_SQ_UCODE0,
-    IN_SQ_STRING_ESCAPE,
-    IN_SQ_STRING,
-    IN_ZERO,
-    IN_DIGITS,
-    IN_DIGIT,
-    IN_EXP_E,
-    IN_MANTISSA,
-    IN_MANTISSA_DIGITS,
-    IN_NONZERO_NUMBER,
-    IN_NEG_NONZERO_NUMBER,
-    IN_KEYWORD,
-    IN_ESCAPE,
-    IN_ESCAPE_L,
-    IN_ESCAPE_LL,
-    IN_ESCAPE_I,
-    IN_ESCAPE_I6,
-    IN_ESCAPE_I64,
-    IN_WHITESPACE,
-    IN_START,
-};
-
-#define TERMINAL(state) [0 ... 0x7F] = (state)
-
-/* Return whether TERMINAL is a terminal state and the transition to it
-   from OLD_STATE required lookahead.  This happens whenever the table
-   below uses the TERMINAL macro.  */
-#define TERMINAL_NEEDED_LOOKAHEAD(old_state, terminal) \
-            (json_lexer[(old_state)][0] == (terminal))
-
-static const uint8_t json_lexer[][256] =  {
-    /* double quote string */
-    [IN_DQ_UCODE3] = {
-        ['0' ... '9'] = IN_DQ_STRING,
-        ['a' ... 'f'] = IN_DQ_STRING,
-        ['A' ... 'F'] = IN_DQ_STRING,
-    },
-    [IN_DQ_UCODE2] = {
-        ['0' ... '9'] = IN_DQ_UCODE3,
-        ['a' ... 'f'] = IN_DQ_UCODE3,
-        ['A' ... 'F'] = IN_DQ_UCODE3,
-    },
-    [IN_DQ_UCODE1] = {
-        ['0' ... '9'] = IN_DQ_UCODE2,
-        ['a' ... 'f'] = IN_DQ_UCODE2,
-        ['A' ... 'F'] = IN_DQ_UCODE2,
-    },
-    [IN_DQ_UCODE0] = {
-        ['0' ... '9'] = IN_DQ_UCODE1,
-        ['a' ... 'f'] = IN_DQ_UCODE1,
-        ['A' ... 'F'] = IN_DQ_UCODE1,
-    },
-    [IN_DQ_STRING_ESCAPE] = {
-        ['b'] = IN_DQ_STRING,
-        ['f'] =  IN_DQ_STRING,
-        ['n'] =  IN_DQ_STRING,
-        ['r'] =  IN_DQ_STRING,
-        ['t'] =  IN_DQ_STRING,
-        ['/'] = IN_DQ_STRING,
-        ['\\'] = IN_DQ_STRING,
-        ['\''] = IN_DQ_STRING,
-        ['\"'] = IN_DQ_STRING,
-        ['u'] = IN_DQ_UCODE0,
-    },
-    [IN_DQ_STRING] = {
-        [1 ... 0xFF] = IN_DQ_STRING,
-        ['\\'] = IN_DQ_STRING_ESCAPE,
-        ['"'] = JSON_STRING,
-    },
-
-    /* single quote string */
-    [IN_SQ_UCODE3] = {
-        ['0' ... '9'] = IN_SQ_STRING,
-        ['a' ... 'f'] = IN_SQ_STRING,
-        ['A' ... 'F'] = IN_SQ_STRING,
-    },
-    [IN_SQ_UCODE2] = {
-        ['0' ... '9'] = IN_SQ_UCODE3,
-        ['a' ... 'f'] = IN_SQ_UCODE3,
-        ['A' ... 'F'] = IN_SQ_UCODE3,
-    },
-    [IN_SQ_UCODE1] = {
-        ['0' ... '9'] = IN_SQ_UCODE2,
-        ['a' ... 'f'] = IN_SQ_UCODE2,
-        ['A' ... 'F'] = IN_SQ_UCODE2,
-    },
-    [IN_SQ_UCODE0] = {
-        ['0' ... '9'] = IN_SQ_UCODE1,
-        ['a' ... 'f'] = IN_SQ_UCODE1,
-        ['A' ... 'F'] = IN_SQ_UCODE1,
-    },
-    [IN_SQ_STRING_ESCAPE] = {
-        ['b'] = IN_SQ_STRING,
-        ['f'] =  IN_SQ_STRING,
-        ['n'] =  IN_SQ_STRING,
-        ['r'] =  IN_SQ_STRING,
-        ['t'] =  IN_SQ_STRING,
-        ['/'] = IN_DQ_STRING,
-        ['\\'] = IN_DQ_STRING,
-        ['\''] = IN_SQ_STRING,
-        ['\"'] = IN_SQ_STRING,
-        ['u'] = IN_SQ_UCODE0,
-    },
-    [IN_SQ_STRING] = {
-        [1 ... 0xFF] = IN_SQ_STRING,
-        ['\\'] = IN_SQ_STRING_ESCAPE,
-        ['\''] = JSON_STRING,
-    },
-
-    /* Zero */
-    [IN_ZERO] = {
-        TERMINAL(JSON_INTEGER),
-        ['0' ... '9'] = ERROR,
-        ['.'] = IN_MANTISSA,
-    },
-
-    /* Float */
-    [IN_DIGITS] = {
-        TERMINAL(JSON_FLOAT),
-        ['0' ... '9'] = IN_DIGITS,
-    },
-
-    [IN_DIGIT] = {
-        ['0' ... '9'] = IN_DIGITS,
-    },
-
-    [IN_EXP_E] = {
-        ['-'] = IN_DIGIT,
-        ['+'] = IN_DIGIT,
-        ['0' ... '9'] = IN_DIGITS,
-    },
-
-    [IN_MANTISSA_DIGITS] = {
-        TERMINAL(JSON_FLOAT),
-        ['0' ... '9'] = IN_MANTISSA_DIGITS,
-        ['e'] = IN_EXP_E,
-        ['E'] = IN_EXP_E,
-    },
-
-    [IN_MANTISSA] = {
-        ['0' ... '9'] = IN_MANTISSA_DIGITS,
-    },
-
-    /* Number */
-    [IN_NONZERO_NUMBER] = {
-        TERMINAL(JSON_INTEGER),
-        ['0' ... '9'] = IN_NONZERO_NUMBER,
-        ['e'] = IN_EXP_E,
-        ['E'] = IN_EXP_E,
-        ['.'] = IN_MANTISSA,
-    },
-
-    [IN_NEG_NONZERO_NUMBER] = {
-        ['0'] = IN_ZERO,
-        ['1' ... '9'] = IN_NONZERO_NUMBER,
-    },
-
-    /* keywords */
-    [IN_KEYWORD] = {
-        TERMINAL(JSON_KEYWORD),
-        ['a' ... 'z'] = IN_KEYWORD,
-    },
-
-    /* whitespace */
-    [IN_WHITESPACE] = {
-        TERMINAL(JSON_SKIP),
-        [' '] = IN_WHITESPACE,
-        ['\t'] = IN_WHITESPACE,
-        ['\r'] = IN_WHITESPACE,
-        ['\n'] = IN_WHITESPACE,
-    },        
-
-    /* escape */
-    [IN_ESCAPE_LL] = {
-        ['d'] = JSON_ESCAPE,
-    },
-
-    [IN_ESCAPE_L] = {
-        ['d'] = JSON_ESCAPE,
-        ['l'] = IN_ESCAPE_LL,
-    },
-
-    [IN_ESCAPE_I64] = {
-        ['d'] = JSON_ESCAPE,
-    },
-
-    [IN_ESCAPE_I6] = {
-        ['4'] = IN_ESCAPE_I64,
-    },
-
-    [IN_ESCAPE_I] = {
-        ['6'] = IN_ESCAPE_I6,
-    },
-
-    [IN_ESCAPE] = {
-        ['d'] = JSON_ESCAPE,
-        ['i'] = JSON_ESCAPE,
-        ['p'] = JSON_ESCAPE,
-        ['s'] = JSON_ESCAPE,
-        ['f'] = JSON_ESCAPE,
-        ['l'] = IN_ESCAPE_L,
-        ['I'] = IN_ESCAPE_I,
-    },
-
-    /* top level rule */
-    [IN_START] = {
-        ['"'] = IN_DQ_STRING,
-        ['\''] = IN_SQ_STRING,
-        ['0'] = IN_ZERO,
-        ['1' ... '9'] = IN_NONZERO_NUMBER,
-        ['-'] = IN_NEG_NONZERO_NUMBER,
-        ['{'] = JSON_OPERATOR,
-        ['}'] = JSON_OPERATOR,
-        ['['] = JSON_OPERATOR,
-        [']'] = JSON_OPERATOR,
-        [','] = JSON_OPERATOR,
-        [':'] = JSON_OPERATOR,
-        ['a' ... 'z'] = IN_KEYWORD,
-        ['%'] = IN_ESCAPE,
-        [' '] = IN_WHITESPACE,
-        ['\t'] = IN_WHITESPACE,
-        ['\r'] = IN_WHITESPACE,
-        ['\n'] = IN_WHITESPACE,
-    },
-};
-
-void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func)
+static inline uint64_t json_lexer_add_digit(uint64_t magnitude, char ch)
 {
-    lexer->emit = func;
-    lexer->state = IN_START;
-    lexer->token = g_string_sized_new (3);
-    lexer->x = lexer->y = 0;
+    unsigned digit = ch - '0';
+
+    if (magnitude > (JSON_LEXER_MAX_MAGNITUDE - digit) / 10) {
+        return JSON_LEXER_MAX_MAGNITUDE;
+    }
+    return magnitude * 10 + digit;
+}
+
+static int64_t json_lexer_magnitude_to_int64(uint64_t magnitude, bool negative)
+{
+    if (magnitude == JSON_LEXER_MAX_MAGNITUDE) {
+        return negative ? INT64_MIN : INT64_MAX;
+    }
+    return negative ? -(int64_t)magnitude : (int64_t)magnitude;
 }
 
-static int json_lexer_feed_char(JSONLexer *lexer, char ch)
+int64_t json_lexer_integer_value(const char *str, size_t len)
+{
+    const char *end = str + len;
+    uint64_t magnitude = 0;
+    bool negative = (str < end && *str == '-');
+
+    for (str += negative; str < end; str++) {
+        magnitude = json_lexer_add_digit(magnitude, *str);
+    }
+    return json_lexer_magnitude_to_int64(magnitude, negative);
+}
+
+/*
+ * Advance *X and *Y past BUFFER, the same way json_lexer_feed_char
+ * does one byte at a time.
+ */
+static void json_lexer_count_lines(const char *buffer, size_t size,
+                                   int *x, int *y)
+{
+    size_t i = 0, last = 0;
+    int lines = 0;
+
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask) {
+            lines += __builtin_popcount(mask);
+            last = i + 31 - __builtin_clz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask) {
+            lines += __builtin_popcount(mask);
+            last = i + 31 - __builtin_clz(mask);
+        }
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (buffer[i] == '\n') {
+            lines++;
+            last = i;
+        }
+    }
+
+    if (lines) {
+        *y += lines;
+        *x = size - 1 - last;
+    } else {
+        *x += size;
+    }
+}
+
+void json_lexer_get_position(JSONLexer *lexer, size_t offset, int *x, int *y)
+{
+    *x = lexer->x;
+    *y = lexer->y;
+    json_lexer_count_lines(lexer->buffer, offset - lexer->offset + 1, x, y);
+}
+
+static void json_lexer_emit(JSONLexer *lexer, JSONTokenType type,
+                            const char *p, const char *end)
+{
+    JSONToken token;
+
+    token.type = type;
+    if (lexer->token->len) {
+        /* The beginning of the token was copied by an earlier feed.  */
+        g_string_append_len(lexer->token, lexer->start, end - lexer->start);
+        token.str = lexer->token->str;
+        token.len = lexer->token->len;
+    } else {
+        token.str = lexer->start;
+        token.len = end - lexer->start;
+    }
+    token.offset = lexer->offset + (p - lexer->buffer);
+    token.value = type == JSON_INTEGER
+        ? json_lexer_magnitude_to_int64(lexer->magnitude, lexer->negative)
+        : 0;
+    if (lexer->flags & JSON_LEXER_LAZY_POSITION) {
+        token.x = token.y = -1;
+    } else {
+        token.x = lexer->x;
+        token.y = lexer->y;
+    }
+    lexer->emit(lexer, &token);
+}
+
+/*
+ * The functions below are specialized for each variant of the lexer.
+ * They are always inlined, so that the table and the LAZY argument
+ * are constants in each copy.
+ */
+static inline __attribute__((always_inline))
+int json_lexer_feed_char(JSONLexer *lexer, const char *p,
+                         const uint8_t *byte_class, const uint8_t *next,
+                         int n_classes, bool lazy)
 {
     int char_consumed, new_state;
+    char ch = *p;
 
-    lexer->x++;
-    if (ch == '\n') {
-        lexer->x = 0;
-        lexer->y++;
+    if (!lazy) {
+        lexer->x++;
+        if (ch == '\n') {
+            lexer->x = 0;
+            lexer->y++;
+        }
     }
 
     do {
-        new_state = json_lexer[lexer->state][(uint8_t)ch];
-        char_consumed = !TERMINAL_NEEDED_LOOKAHEAD(lexer->state, new_state);
-        if (char_consumed) {
-            g_string_append_c(lexer->token, ch);
-        }
+        new_state = next[lexer->state * n_classes + byte_class[(uint8_t)ch]];
+        char_consumed = !(new_state & JSON_LEXER_LOOKAHEAD);
+        new_state &= ~JSON_LEXER_LOOKAHEAD;
 
         switch (new_state) {
         case JSON_OPERATOR:
@@ -294,11 +180,20 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch)
         case JSON_FLOAT:
         case JSON_KEYWORD:
         case JSON_STRING:
-            lexer->emit(lexer, lexer->token, new_state, lexer->x, lexer->y);
+            json_lexer_emit(lexer, new_state, p, char_consumed ? p + 1 : p);
         case JSON_SKIP:
             g_string_truncate(lexer->token, 0);
+            lexer->start = char_consumed ? p + 1 : p;
+            lexer->magnitude = 0;
+            lexer->negative = false;
             new_state = IN_START;
             break;
+        case IN_NEG_NONZERO_NUMBER:
+            lexer->negative = true;
+            break;
+        case IN_NONZERO_NUMBER:
+            lexer->magnitude = json_lexer_add_digit(lexer->magnitude, ch);
+            break;
         case ERROR:
             return -EINVAL;
         default:
@@ -309,25 +204,564 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch)
     return 0;
 }
 
-int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
+/*
+ * Return the length of the longest prefix of BUFFER that has no quotes,
+ * backslashes or control characters.  These are the only bytes for which
+ * the string states of the DFA do something else than looping back to
+ * themselves, so the whole prefix can be added to the token at once.
+ */
+static size_t json_lexer_scan_string(const char *buffer, size_t size)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i dq = _mm256_set1_epi8('"');
+    const __m256i sq = _mm256_set1_epi8('\'');
+    const __m256i bs = _mm256_set1_epi8('\\');
+    const __m256i ctl = _mm256_set1_epi8(0x1F);
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, dq), _mm256_cmpeq_epi8(v, sq)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, bs),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v)));
+        uint32_t mask = _mm256_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i dq = _mm_set1_epi8('"');
+    const __m128i sq = _mm_set1_epi8('\'');
+    const __m128i bs = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, sq)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, bs),
+                         _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v)));
+        uint32_t mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i < size; i++) {
+        uint8_t ch = buffer[i];
+        if (ch == '"' || ch == '\'' || ch == '\\' || ch < 0x20) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * The states below loop back to themselves on a small set of bytes.
+ * Runs of these bytes are consumed without going through the DFA.
+ */
+static size_t json_lexer_scan_whitespace(const char *buffer, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (buffer[i] != ' ' && buffer[i] != '\t' &&
+            buffer[i] != '\r' && buffer[i] != '\n') {
+            break;
+        }
+    }
+    return i;
+}
+
+static size_t json_lexer_scan_digits(const char *buffer, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size && buffer[i] >= '0' && buffer[i] <= '9'; i++) {
+        continue;
+    }
+    return i;
+}
+
+/* Like json_lexer_scan_digits, but also accumulate the integer value.  */
+static size_t json_lexer_scan_integer(JSONLexer *lexer,
+                                      const char *buffer, size_t size)
+{
+    uint64_t magnitude = lexer->magnitude;
+    size_t i;
+
+    for (i = 0; i < size && buffer[i] >= '0' && buffer[i] <= '9'; i++) {
+        magnitude = json_lexer_add_digit(magnitude, buffer[i]);
+    }
+    lexer->magnitude = magnitude;
+    return i;
+}
+
+static size_t json_lexer_scan_keyword(const char *buffer, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size && buffer[i] >= 'a' && buffer[i] <= 'z'; i++) {
+        continue;
+    }
+    return i;
+}
+
+static inline __attribute__((always_inline))
+int json_lexer_feed_variant(JSONLexer *lexer, const char *buffer, size_t size,
+                            const uint8_t *byte_class, const uint8_t *next,
+                            int n_classes, bool lazy)
 {
     size_t i;
 
+    lexer->buffer = buffer;
+    lexer->start = buffer;
     for (i = 0; i < size; i++) {
+        bool bad_utf8 = false;
+        size_t n, valid;
         int err;
 
-        err = json_lexer_feed_char(lexer, buffer[i]);
+        /* Let the DFA only see the bytes that end a run.  */
+        switch (lexer->state) {
+        case IN_DQ_STRING:
+        case IN_SQ_STRING:
+            /*
+             * Multi-byte characters cannot contain the bytes that end
+             * the run, but a run can end in the middle of a character
+             * if the buffer does.
+             */
+            n = json_lexer_scan_string(buffer + i, size - i);
+            valid = json_utf8_validate(&lexer->utf8, buffer + i, n);
+            bad_utf8 = valid < n ||
+                (i + n < size && !json_utf8_complete(&lexer->utf8));
+            n = valid;
+            break;
+        case IN_WHITESPACE:
+            n = json_lexer_scan_whitespace(buffer + i, size - i);
+            break;
+        case IN_NONZERO_NUMBER:
+            n = json_lexer_scan_integer(lexer, buffer + i, size - i);
+            break;
+        case IN_DIGITS:
+        case IN_MANTISSA_DIGITS:
+            n = json_lexer_scan_digits(buffer + i, size - i);
+            break;
+        case IN_KEYWORD:
+            n = json_lexer_scan_keyword(buffer + i, size - i);
+            break;
+        default:
+            n = 0;
+            break;
+        }
+        if (n && !lazy) {
+            json_lexer_count_lines(buffer + i, n, &lexer->x, &lexer->y);
+        }
+        i += n;
+        if (i == size) {
+            break;
+        }
+
+        if (bad_utf8) {
+            err = -EINVAL;
+        } else {
+            err = json_lexer_feed_char(lexer, buffer + i, byte_class, next,
+                                       n_classes, lazy);
+        }
         if (err < 0) {
+            if (lazy) {
+                json_lexer_count_lines(buffer, i + 1, &lexer->x, &lexer->y);
+            } else if (bad_utf8) {
+                json_lexer_count_lines(buffer + i, 1, &lexer->x, &lexer->y);
+            }
+            if (lexer->state != IN_START && lexer->state != IN_WHITESPACE) {
+                g_string_append_len(lexer->token, lexer->start,
+                                    buffer + i - lexer->start);
+            }
+            lexer->offset += i + 1;
             return err;
         }
     }
 
+    /* Tokens are spans of BUFFER; copy the part that the next feed needs.  */
+    if (lexer->state != IN_START && lexer->state != IN_WHITESPACE) {
+        g_string_append_len(lexer->token, lexer->start,
+                            buffer + size - lexer->start);
+    }
+    if (lazy) {
+        json_lexer_count_lines(buffer, size, &lexer->x, &lexer->y);
+    }
+    lexer->offset += size;
+    lexer->buffer = NULL;
+    lexer->start = NULL;
     return 0;
 }
 
+#define JSON_LEXER_VARIANT(name, table, lazy)                              \
+    static int json_lexer_feed_##name(JSONLexer *lexer,                     \
+                                      const char *buffer, size_t size)      \
+    {                                                                       \
+        return json_lexer_feed_variant(lexer, buffer, size,                 \
+                                       json_lexer_class_##table,            \
+                                       &json_lexer_next_##table[0][0],      \
+                                       sizeof(json_lexer_next_##table[0]),  \
+                                       lazy);                               \
+    }
+
+JSON_LEXER_VARIANT(strict, strict, false)
+JSON_LEXER_VARIANT(strict_lazy, strict, true)
+JSON_LEXER_VARIANT(default, default, false)
+JSON_LEXER_VARIANT(default_lazy, default, true)
+JSON_LEXER_VARIANT(escapes, escapes, false)
+JSON_LEXER_VARIANT(escapes_lazy, escapes, true)
+
+void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func, int flags)
+{
+    bool lazy = flags & JSON_LEXER_LAZY_POSITION;
+
+    if (flags & JSON_LEXER_STRICT) {
+        lexer->feed = lazy ? json_lexer_feed_strict_lazy
+                           : json_lexer_feed_strict;
+    } else if (flags & JSON_LEXER_ESCAPES) {
+        lexer->feed = lazy ? json_lexer_feed_escapes_lazy
+                           : json_lexer_feed_escapes;
+    } else {
+        lexer->feed = lazy ? json_lexer_feed_default_lazy
+                           : json_lexer_feed_default;
+    }
+    lexer->emit = func;
+    lexer->flags = flags;
+    lexer->state = IN_START;
+    lexer->buffer = NULL;
+    lexer->start = NULL;
+    lexer->offset = 0;
+    lexer->token = g_string_sized_new (3);
+    lexer->magnitude = 0;
+    lexer->negative = false;
+    json_utf8_init(&lexer->utf8);
+    lexer->threads = 1;
+    lexer->x = lexer->y = 0;
+}
+
+void json_lexer_set_threads(JSONLexer *lexer, int threads)
+{
+    lexer->threads = MAX(threads, 1);
+}
+
+/*
+ * Parallel lexing
+ *
+ * The buffer is split into chunks that begin right after an operator.
+ * At that point the lexer is either between tokens or, if the operator
+ * was part of a string, inside a string; any other state would have
+ * failed on the operator.  Which one it is only depends on the quotes
+ * and backslashes before the boundary, so a quick scan for them finds
+ * the entry state of every chunk, and each chunk is lexed only once
+ * by its own thread, recording the tokens instead of emitting them.
+ * The first chunk is lexed for real in the calling thread and the
+ * others are replayed to the emitter in order.  The scan assumes valid
+ * text; a chunk whose entry state turns out to be different from the
+ * state at the end of the previous one, or whose run failed, is lexed
+ * again sequentially to get the tokens and the error right.
+ */
+#define JSON_LEXER_MIN_CHUNK (1 << 20)
+
+/*
+ * A token of a chunk, relative to the start of the chunk.  A JSONToken
+ * is four times bigger, and writing the records costs more than lexing
+ * does; the value of an integer is cheap to compute again.
+ */
+typedef struct JSONLexerRecord
+{
+    uint32_t offset;
+    uint32_t len;
+    uint8_t type;
+    /* Whether the byte at OFFSET is the last one of the token.  */
+    bool consumed;
+} JSONLexerRecord;
+
+typedef struct JSONLexerRun
+{
+    JSONLexerRecord *records;
+    size_t n_records;
+    size_t max_records;
+    bool failed;
+    int state;
+    uint64_t magnitude;
+    bool negative;
+    JSONUTF8State utf8;
+    /* Length of the token that is in progress at the end of the chunk.  */
+    size_t partial;
+} JSONLexerRun;
+
+typedef struct JSONLexerChunk
+{
+    JSONLexer lexer;
+    GThread *thread;
+    int flags;
+    const char *start;
+    size_t size;
+    int entry_state;
+    JSONLexerRun run;
+} JSONLexerChunk;
+
+static void json_lexer_record(JSONLexer *lexer, const JSONToken *token)
+{
+    JSONLexerChunk *chunk = container_of(lexer, JSONLexerChunk, lexer);
+    JSONLexerRun *run = &chunk->run;
+    JSONLexerRecord record = {
+        .offset = token->offset,
+        .len = token->len,
+        .type = token->type,
+        .consumed = token->str + token->len > chunk->start + token->offset,
+    };
+
+    /* This runs once per token, so avoid g_array_append_val.  */
+    if (run->n_records == run->max_records) {
+        run->max_records = MAX(run->max_records * 2, 4096);
+        run->records = g_renew(JSONLexerRecord, run->records,
+                               run->max_records);
+    }
+    run->records[run->n_records++] = record;
+}
+
+static gpointer json_lexer_chunk_thread(gpointer opaque)
+{
+    JSONLexerChunk *chunk = opaque;
+    JSONLexer *lexer = &chunk->lexer;
+    JSONLexerRun *run = &chunk->run;
+
+    json_lexer_init(lexer, json_lexer_record,
+                    chunk->flags | JSON_LEXER_LAZY_POSITION);
+    lexer->state = chunk->entry_state;
+    run->failed = lexer->feed(lexer, chunk->start, chunk->size) < 0;
+    run->state = lexer->state;
+    run->magnitude = lexer->magnitude;
+    run->negative = lexer->negative;
+    run->utf8 = lexer->utf8;
+    run->partial = lexer->token->len;
+    json_lexer_destroy(lexer);
+    return NULL;
+}
+
+/* Emit the tokens of RUN as if json_lexer_feed had lexed them.  */
+static void json_lexer_replay(JSONLexer *lexer, const char *start, size_t size,
+                              JSONLexerRun *run)
+{
+    bool lazy = lexer->flags & JSON_LEXER_LAZY_POSITION;
+    const char *counted = start;
+    JSONToken token;
+    size_t i;
+
+    lexer->buffer = start;
+    token.x = token.y = -1;
+    for (i = 0; i < run->n_records; i++) {
+        JSONLexerRecord *record = &run->records[i];
+        const char *p = start + record->offset;
+        const char *end = p + record->consumed;
+
+        token.type = record->type;
+        if (lexer->token->len) {
+            /* The token began in an earlier chunk.  */
+            g_string_append_len(lexer->token, start, end - start);
+            token.str = lexer->token->str;
+            token.len = lexer->token->len;
+        } else {
+            token.str = end - record->len;
+            token.len = record->len;
+        }
+        token.offset = lexer->offset + record->offset;
+        token.value = token.type == JSON_INTEGER
+            ? json_lexer_integer_value(token.str, token.len)
+            : 0;
+        if (!lazy) {
+            if (p + 1 > counted) {
+                json_lexer_count_lines(counted, p + 1 - counted,
+                                       &lexer->x, &lexer->y);
+                counted = p + 1;
+            }
+            token.x = lexer->x;
+            token.y = lexer->y;
+        }
+        lexer->emit(lexer, &token);
+        g_string_truncate(lexer->token, 0);
+    }
+
+    g_string_append_len(lexer->token, start + size - run->partial,
+                        run->partial);
+    json_lexer_count_lines(counted, start + size - counted,
+                           &lexer->x, &lexer->y);
+    lexer->state = run->state;
+    lexer->magnitude = run->magnitude;
+    lexer->negative = run->negative;
+    lexer->utf8 = run->utf8;
+    lexer->offset += size;
+    lexer->buffer = NULL;
+    lexer->start = NULL;
+}
+
+static const char *json_lexer_find_boundary(const char *p, const char *end)
+{
+    for (; p < end; p++) {
+        switch (*p) {
+        case '{': case '}': case '[': case ']': case ',': case ':':
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Return the state at END of a lexer that is in STATE at P, which is
+ * IN_START or inside a string.  In valid text only quotes matter, and
+ * backslashes inside strings because they can escape one.  P follows
+ * an operator, so it cannot be in the middle of an escape.
+ */
+static int json_lexer_skip_strings(const char *p, const char *end,
+                                   int state, bool single_quotes)
+{
+    static const bool stops_start[256] = { ['"'] = true, ['\''] = true };
+    static const bool stops_dq[256] = { ['"'] = true, ['\\'] = true };
+    static const bool stops_sq[256] = { ['\''] = true, ['\\'] = true };
+    const bool *stops;
+    char ch;
+
+    while (p < end) {
+        stops = state == IN_START ? stops_start
+            : state == IN_DQ_STRING ? stops_dq : stops_sq;
+        while (p < end && !stops[(uint8_t)*p]) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        ch = *p++;
+        if (ch == '\\') {
+            p++;
+        } else if (state != IN_START) {
+            state = IN_START;
+        } else if (ch == '"') {
+            state = IN_DQ_STRING;
+        } else if (single_quotes) {
+            state = IN_SQ_STRING;
+        }
+    }
+    return state;
+}
+
+int json_lexer_feed_parallel(JSONLexer *lexer, const char *buffer, size_t size,
+                             int n_chunks)
+{
+    const char *end = buffer + size;
+    const char *first_end = end;
+    bool single_quotes = !(lexer->flags & JSON_LEXER_STRICT);
+    JSONLexerChunk *chunks;
+    int state = lexer->state;
+    int i, n = 0;
+    int err;
+
+    chunks = g_new0(JSONLexerChunk, MAX(n_chunks, 1));
+    for (i = 1; i < n_chunks; i++) {
+        const char *p = buffer + size / n_chunks * i;
+        const char *prev = n ? chunks[n - 1].start : buffer;
+
+        p = json_lexer_find_boundary(MAX(p, prev + 1), end);
+        if (!p || p == end) {
+            break;
+        }
+        chunks[n].start = p;
+        chunks[n].flags = lexer->flags;
+        n++;
+    }
+
+    /*
+     * A chunk that is not between tokens or in a string at the start
+     * of the buffer cannot be guessed; it will be lexed sequentially.
+     */
+    if (state != IN_START && state != IN_DQ_STRING &&
+        (state != IN_SQ_STRING || !single_quotes)) {
+        state = -1;
+    }
+    for (i = 0; i < n; i++) {
+        const char *prev = i ? chunks[i - 1].start : buffer;
+
+        chunks[i].size = (i + 1 < n ? chunks[i + 1].start : end) -
+            chunks[i].start;
+        if (state != -1) {
+            state = json_lexer_skip_strings(prev, chunks[i].start, state,
+                                            single_quotes);
+        }
+        /* Records have 32-bit offsets.  */
+        chunks[i].entry_state = chunks[i].size <= UINT32_MAX ? state : -1;
+        if (chunks[i].entry_state != -1) {
+            chunks[i].thread = g_thread_new("json-lexer",
+                                            json_lexer_chunk_thread,
+                                            &chunks[i]);
+        }
+    }
+
+    if (n) {
+        first_end = chunks[0].start;
+    }
+    err = lexer->feed(lexer, buffer, first_end - buffer);
+
+    for (i = 0; i < n; i++) {
+        JSONLexerChunk *chunk = &chunks[i];
+
+        if (chunk->thread) {
+            g_thread_join(chunk->thread);
+        }
+        if (!err && chunk->thread && !chunk->run.failed &&
+            chunk->entry_state == lexer->state) {
+            json_lexer_replay(lexer, chunk->start, chunk->size, &chunk->run);
+        } else if (!err) {
+            err = lexer->feed(lexer, chunk->start, chunk->size);
+        }
+        g_free(chunk->run.records);
+    }
+
+    g_free(chunks);
+    return err;
+}
+
+int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
+{
+    if (lexer->threads > 1 && size >= 2 * JSON_LEXER_MIN_CHUNK) {
+        return json_lexer_feed_parallel(lexer, buffer, size,
+                                        MIN(lexer->threads,
+                                            size / JSON_LEXER_MIN_CHUNK));
+    }
+    return lexer->feed(lexer, buffer, size);
+}
+
+void json_lexer_reset(JSONLexer *lexer)
+{
+    lexer->state = IN_START;
+    g_string_truncate(lexer->token, 0);
+    lexer->magnitude = 0;
+    lexer->negative = false;
+    json_utf8_init(&lexer->utf8);
+}
+
+void json_lexer_skip(JSONLexer *lexer, const char *buffer, size_t size)
+{
+    json_lexer_count_lines(buffer, size, &lexer->x, &lexer->y);
+    lexer->offset += size;
+}
+
+void json_lexer_discard(JSONLexer *lexer)
+{
+    g_string_free(lexer->token, TRUE);
+    lexer->token = g_string_sized_new (3);
+}
+
 int json_lexer_flush(JSONLexer *lexer)
 {
-    return lexer->state == IN_START ? 0 : json_lexer_feed_char(lexer, 0);
+    static const char eoi = 0;
+
+    return lexer->state == IN_START ? 0 : json_lexer_feed(lexer, &eoi, 1);
 }
 
 void json_lexer_destroy(JSONLexer *lexer)
@@ -19,6 +19,10 @@
 #include <glib.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "json-utf8.h"
 
 #ifndef offsetof
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *) 0)->MEMBER)
@@ -40,30 +44,134 @@ typedef enum json_token_type {
     JSON_SKIP,
 } JSONTokenType;
 
+/*
+ * A token is a span of the input.  The lexer checks that strings are
+ * valid UTF-8.  STR is not NUL-terminated; it points
+ * into the buffer passed to json_lexer_feed, unless the token straddles
+ * two calls to json_lexer_feed.  In that case STR points to a copy that
+ * is only valid until the emitter returns.
+ *
+ * OFFSET, X and Y are those of the byte that ended the token, which for
+ * numbers and keywords is the one after it.
+ *
+ * For JSON_INTEGER tokens, VALUE is the value of the token, saturated
+ * to the range of int64_t like strtoll does.
+ */
 typedef struct JSONToken
 {
     int type;
-    char *str;
+    const char *str;
+    size_t len;
+    size_t offset;
+    int64_t value;
     int x;
     int y;
 } JSONToken;
 
+/* Return the stream offset just past the last byte of TOKEN.  */
+static inline size_t json_token_end(const JSONToken *token)
+{
+    switch (token->type) {
+    case JSON_INTEGER:
+    case JSON_FLOAT:
+    case JSON_KEYWORD:
+        return token->offset;
+    default:
+        return token->offset + 1;
+    }
+}
+
+typedef enum JSONLexerFlags {
+    /*
+     * Do not track the line and column of every byte.  Tokens have X
+     * and Y set to -1; json_lexer_get_position computes them from the
+     * token's offset if needed.
+     */
+    JSON_LEXER_LAZY_POSITION = 1 << 0,
+
+    /* Accept the %-escapes that g_variant_from_jsonf uses.  */
+    JSON_LEXER_ESCAPES = 1 << 1,
+
+    /*
+     * Only accept RFC 8259 JSON: no single-quoted strings and no escapes.
+     * This takes precedence over JSON_LEXER_ESCAPES.
+     */
+    JSON_LEXER_STRICT = 1 << 2,
+} JSONLexerFlags;
+
 typedef struct JSONLexer JSONLexer;
 
-typedef void (JSONLexerEmitter)(JSONLexer *, GString *, JSONTokenType, int x, int y);
+typedef void (JSONLexerEmitter)(JSONLexer *, const JSONToken *);
 
 struct JSONLexer
 {
+    /* The variant of the lexer that json_lexer_init picked.  */
+    int (*feed)(JSONLexer *lexer, const char *buffer, size_t size);
     JSONLexerEmitter *emit;
+    int flags;
     int state;
+    const char *buffer;
+    const char *start;
+    size_t offset;
     GString *token;
+    uint64_t magnitude;
+    bool negative;
+    JSONUTF8State utf8;
+    int threads;
     int x, y;
 };
 
-void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func);
+void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func, int flags);
+
+/*
+ * With JSON_LEXER_LAZY_POSITION, return the line and column of OFFSET,
+ * which must be within the buffer that is being fed.  This can be
+ * called from the emitter.  After json_lexer_feed fails, the position
+ * of the bad byte is in the lexer's X and Y fields in either mode; the
+ * OFFSET field is just past it, and TOKEN has the text before it that
+ * was part of the same token.
+ */
+void json_lexer_get_position(JSONLexer *lexer, size_t offset, int *x, int *y);
+
+/* Return the value of the integer in STR, as it would be in a token.  */
+int64_t json_lexer_integer_value(const char *str, size_t len);
 
 int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size);
 
+/*
+ * Let json_lexer_feed split large buffers among up to THREADS threads.
+ * Tokens are still emitted in order, from the thread that calls
+ * json_lexer_feed.
+ */
+void json_lexer_set_threads(JSONLexer *lexer, int threads);
+
+/*
+ * Lex BUFFER in up to N_CHUNKS pieces at the same time.  The emitter
+ * sees exactly the same tokens as with json_lexer_feed.
+ */
+int json_lexer_feed_parallel(JSONLexer *lexer, const char *buffer, size_t size,
+                             int n_chunks);
+
+/*
+ * Forget the token being lexed, or an error, and start again from
+ * whitespace.  The offset and the position are left alone.
+ */
+void json_lexer_reset(JSONLexer *lexer);
+
+/*
+ * Account for SIZE bytes of BUFFER that are dropped instead of being
+ * fed, usually after json_lexer_reset: only the offset and the position
+ * move past them.
+ */
+void json_lexer_skip(JSONLexer *lexer, const char *buffer, size_t size);
+
+/*
+ * Free the text that was copied for a token that is not complete yet.
+ * The token is still emitted when it ends, but only with the text from
+ * the last feed.
+ */
+void json_lexer_discard(JSONLexer *lexer);
+
 int json_lexer_flush(JSONLexer *lexer);
 
 void json_lexer_destroy(JSONLexer *lexer);
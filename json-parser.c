@@ -24,10 +24,6 @@
 #include "json-parser.h"
 #include "json-lexer.h"
 
-typedef struct JSONParserContext
-{
-} JSONParserContext;
-
 #define BUG_ON(cond) assert(!(cond))
 
 /**
@@ -36,11 +32,8 @@ typedef struct JSONParserContext
  * 0) make errors meaningful again
  * 1) add geometry information to tokens
  * 3) should we return a parsed size?
- * 4) deal with premature EOI
  */
 
-static GVariant *parse_value(JSONParserContext *ctxt, GQueue *tokens, va_list *ap);
-
 /**
  * Token manipulators
  *
@@ -48,42 +41,26 @@ static GVariant *parse_value(JSONParserContext *ctxt, GQueue *tokens, va_list *a
  * about a token identified by the lexer.  These are routines that make working with
  * these objects a bit easier.
  */
-static int token_is_operator(JSONToken *obj, char op)
+static int token_equals(const JSONToken *obj, const char *value)
 {
-    const char *val;
-
-    if (obj->type != JSON_OPERATOR) {
-        return 0;
-    }
+    size_t len = strlen(value);
 
-    val = obj->str;
-
-    return (val[0] == op) && (val[1] == 0);
+    return (obj->len == len) && (memcmp(obj->str, value, len) == 0);
 }
 
-static int token_is_keyword(JSONToken *obj, const char *value)
+static int token_is_keyword(const JSONToken *obj, const char *value)
 {
     if (obj->type != JSON_KEYWORD) {
         return 0;
     }
 
-    return strcmp(obj->str, value) == 0;
-}
-
-static int token_is_escape(JSONToken *obj, const char *value)
-{
-    if (obj->type != JSON_ESCAPE) {
-        return 0;
-    }
-
-    return (strcmp(obj->str, value) == 0);
+    return token_equals(obj, value);
 }
 
 /**
  * Error handler
  */
-static void parse_error(JSONParserContext *ctxt,
-			JSONToken *token, const char *msg, ...)
+static void parse_error(const JSONToken *token, const char *msg, ...)
 {
     va_list ap;
     va_start(ap, msg);
@@ -98,7 +75,7 @@ static void parse_error(JSONParserContext *ctxt,
  *
  * These helpers are used to unescape strings.
  */
-static void wchar_to_utf8(uint16_t wchar, char *buffer, size_t buffer_length)
+static void wchar_to_utf8(uint32_t wchar, char *buffer, size_t buffer_length)
 {
     if (wchar <= 0x007F) {
         BUG_ON(buffer_length < 2);
@@ -111,13 +88,21 @@ static void wchar_to_utf8(uint16_t wchar, char *buffer, size_t buffer_length)
         buffer[0] = 0xC0 | ((wchar >> 6) & 0x1F);
         buffer[1] = 0x80 | (wchar & 0x3F);
         buffer[2] = 0;
-    } else {
+    } else if (wchar <= 0xFFFF) {
         BUG_ON(buffer_length < 4);
 
         buffer[0] = 0xE0 | ((wchar >> 12) & 0x0F);
         buffer[1] = 0x80 | ((wchar >> 6) & 0x3F);
         buffer[2] = 0x80 | (wchar & 0x3F);
         buffer[3] = 0;
+    } else {
+        BUG_ON(buffer_length < 5);
+
+        buffer[0] = 0xF0 | ((wchar >> 18) & 0x07);
+        buffer[1] = 0x80 | ((wchar >> 12) & 0x3F);
+        buffer[2] = 0x80 | ((wchar >> 6) & 0x3F);
+        buffer[3] = 0x80 | (wchar & 0x3F);
+        buffer[4] = 0;
     }
 }
 
@@ -134,6 +119,21 @@ static int hex2decimal(char ch)
     return -1;
 }
 
+/* Return the value of the four hex digits at PTR, or -1.  */
+static int hex4_to_wchar(const char *ptr)
+{
+    int i, wchar = 0;
+
+    for (i = 0; i < 4; i++) {
+        int decimal = hex2decimal(ptr[i]);
+        if (decimal == -1) {
+            return -1;
+        }
+        wchar = (wchar << 4) | decimal;
+    }
+    return wchar;
+}
+
 /**
  * parse_string(): Parse a json string and return a GVariant
  *
@@ -156,24 +156,27 @@ static int hex2decimal(char ch)
  *      \r
  *      \t
  *      \u four-hex-digits 
+ *
+ * Characters outside the BMP are written as a surrogate pair of \u
+ * escapes.  Unpaired surrogates cannot be represented in UTF-8 and are
+ * rejected.
+ *
+ * The lexer has already validated the UTF-8 in the token, so the
+ * result is built as trusted GVariant data.
  */
-static GVariant *g_variant_from_escaped_str(JSONParserContext *ctxt, JSONToken *token)
+static GVariant *g_variant_from_escaped_str(const JSONToken *token)
 {
     const char *ptr = token->str;
+    const char *end = token->str + token->len - 1;
     GVariant *var = NULL;
     GString *str;
-    int double_quote = 1;
+    GBytes *bytes;
 
-    if (*ptr == '"') {
-        double_quote = 1;
-    } else {
-        double_quote = 0;
-    }
+    /* Skip the quotes; the lexer already checked that they match.  */
     ptr++;
 
     str = g_string_sized_new(10);
-    while (*ptr && 
-           ((double_quote && *ptr != '"') || (!double_quote && *ptr != '\''))) {
+    while (ptr < end) {
         if (*ptr == '\\') {
             ptr++;
 
@@ -215,29 +218,38 @@ static GVariant *g_variant_from_escaped_str(JSONParserContext *ctxt, JSONToken *
                 ptr++;
                 break;
             case 'u': {
-                uint16_t unicode_char = 0;
-                char utf8_char[4];
-                int i = 0;
-
-                ptr++;
+                int unicode_char, low;
+                char utf8_char[5];
+
+                unicode_char = end - ptr > 4 ? hex4_to_wchar(ptr + 1) : -1;
+                if (unicode_char == -1) {
+                    parse_error(token,
+                                "invalid hex escape sequence in string");
+                    goto out;
+                }
+                ptr += 5;
 
-                for (i = 0; i < 4; i++) {
-		    int decimal = hex2decimal(*ptr);
-                    if (decimal != -1) {
-                        unicode_char |= decimal << ((3 - i) * 4);
-                    } else {
-                        parse_error(ctxt, token,
-                                    "invalid hex escape sequence in string");
+                if (unicode_char >= 0xD800 && unicode_char <= 0xDFFF) {
+                    low = -1;
+                    if (unicode_char <= 0xDBFF && end - ptr > 5 &&
+                        ptr[0] == '\\' && ptr[1] == 'u') {
+                        low = hex4_to_wchar(ptr + 2);
+                    }
+                    if (low < 0xDC00 || low > 0xDFFF) {
+                        parse_error(token,
+                                    "unpaired surrogate in string");
                         goto out;
                     }
-                    ptr++;
+                    unicode_char = 0x10000 + ((unicode_char - 0xD800) << 10) +
+                        (low - 0xDC00);
+                    ptr += 6;
                 }
 
                 wchar_to_utf8(unicode_char, utf8_char, sizeof(utf8_char));
                 g_string_append(str, utf8_char);
             }   break;
             default:
-                parse_error(ctxt, token, "invalid escape sequence in string");
+                parse_error(token, "invalid escape sequence in string");
                 goto out;
             }
         } else {
@@ -245,269 +257,705 @@ static GVariant *g_variant_from_escaped_str(JSONParserContext *ctxt, JSONToken *
         }
     }
 
-    var = g_variant_new_string (str->str);
+    /* The serialized form of a string includes the terminating NUL.  */
+    g_string_append_c(str, 0);
+    bytes = g_string_free_to_bytes(str);
+    var = g_variant_new_from_bytes(G_VARIANT_TYPE_STRING, bytes, TRUE);
+    g_bytes_unref(bytes);
+    return var;
 
 out:
     g_string_free(str, TRUE);
     return var;
 }
 
-/**
- * Parsing rules
- */
-static int parse_pair(JSONParserContext *ctxt, GVariantBuilder *builder, GQueue *tokens, va_list *ap)
+static GVariant *token_to_keyword(const JSONToken *token)
 {
-    GVariant *key, *value;
-    JSONToken *peek;
-
-    key = parse_value(ctxt, tokens, ap);
-    if (!key || !g_variant_is_of_type(key, G_VARIANT_TYPE_STRING)) {
-        parse_error(ctxt, peek, "key is not a string in object");
-        goto out;
+    if (token_is_keyword(token, "true")) {
+        return g_variant_new_boolean(TRUE);
+    } else if (token_is_keyword(token, "false")) {
+        return g_variant_new_boolean(FALSE);
     }
 
-    peek = g_queue_peek_head(tokens);
-    if (!token_is_operator(peek, ':')) {
-        parse_error(ctxt, peek, "missing : in object pair");
-        goto out;
-    }
+    parse_error(token, "invalid keyword `%.*s'",
+                (int) token->len, token->str);
+    return NULL;
+}
 
-    g_queue_pop_head(tokens);
-    peek = g_queue_peek_head(tokens);
-    value = parse_value(ctxt, tokens, ap);
-    if (value == NULL) {
-        parse_error(ctxt, peek, "Missing value in dict");
-        goto out;
+JSONEscape json_parser_escape_kind(const JSONToken *token)
+{
+    if (token->type != JSON_ESCAPE) {
+        return JSON_ESCAPE_NONE;
     }
 
-    g_variant_builder_add (builder, "{sv}",
-			   g_variant_get_string (key, NULL),
-			   value);
-    g_variant_unref (key);
-    return 0;
+    switch (token->len) {
+    case 2:
+        switch (token->str[1]) {
+        case 'p':
+            return JSON_ESCAPE_VARIANT;
+        case 'i':
+            return JSON_ESCAPE_BOOLEAN;
+        case 'd':
+            return JSON_ESCAPE_INT;
+        case 's':
+            return JSON_ESCAPE_STRING;
+        case 'f':
+            return JSON_ESCAPE_DOUBLE;
+        }
+        break;
+    case 3:
+        if (token_equals(token, "%ld")) {
+            return JSON_ESCAPE_LONG;
+        }
+        break;
+    case 4:
+    case 5:
+        if (token_equals(token, "%lld") || token_equals(token, "%I64d")) {
+            return JSON_ESCAPE_LONG_LONG;
+        }
+        break;
+    }
+    return JSON_ESCAPE_NONE;
+}
 
-out:
-    if (key != NULL) {
-        g_variant_unref(key);
+GVariant *json_parser_escape_value(JSONEscape kind, va_list *ap)
+{
+    switch (kind) {
+    case JSON_ESCAPE_VARIANT:
+        return va_arg(*ap, GVariant *);
+    case JSON_ESCAPE_BOOLEAN:
+        return g_variant_new_boolean(va_arg(*ap, int));
+    case JSON_ESCAPE_INT:
+        return g_variant_new_int64(va_arg(*ap, int));
+    case JSON_ESCAPE_LONG:
+        return g_variant_new_int64(va_arg(*ap, long));
+    case JSON_ESCAPE_LONG_LONG:
+        return g_variant_new_int64(va_arg(*ap, long long));
+    case JSON_ESCAPE_STRING:
+        return g_variant_new_string(va_arg(*ap, const char *));
+    case JSON_ESCAPE_DOUBLE:
+        return g_variant_new_double(va_arg(*ap, double));
+    default:
+        return NULL;
     }
-    return -1;
 }
 
-static GVariant *parse_object(JSONParserContext *ctxt, GQueue *tokens, va_list *ap)
+static GVariant *token_to_literal(const JSONToken *token)
 {
-    static GVariantType *BOXED_DICTIONARY;
-    GVariantBuilder builder;
-    JSONToken *peek;
+    GVariant *obj;
+    char buf[64], *num;
 
-    peek = g_queue_peek_head (tokens);
-    if (!token_is_operator(peek, '{')) {
-        goto out_not_object;
+    switch (token->type) {
+    case JSON_STRING:
+        return g_variant_from_escaped_str(token);
+    case JSON_INTEGER:
+        /* The lexer already computed the value.  */
+        return g_variant_new_int64(token->value);
+    default:
+        break;
     }
 
-    g_queue_pop_head (tokens);
-    peek = g_queue_peek_head (tokens);
-    if (!BOXED_DICTIONARY) {
-        BOXED_DICTIONARY = g_variant_type_new ("a{sv}");
+    /* The token is not NUL-terminated.  */
+    if (token->len < sizeof(buf)) {
+        memcpy(buf, token->str, token->len);
+        buf[token->len] = 0;
+        num = buf;
+    } else {
+        num = g_strndup(token->str, token->len);
     }
-    g_variant_builder_init (&builder, BOXED_DICTIONARY);
-    if (!token_is_operator(peek, '}')) {
-        for (;;) {
-            if (parse_pair(ctxt, &builder, tokens, ap) == -1) {
-                goto out;
-            }
+    /* FIXME dependent on locale */
+    obj = g_variant_new_double(strtod(num, NULL));
+    if (num != buf) {
+        g_free(num);
+    }
+    return obj;
+}
 
-            peek = g_queue_peek_head (tokens);
-            if (token_is_operator(peek, '}')) {
-                break;
-            }
-            if (!token_is_operator(peek, ',')) {
-                parse_error(ctxt, peek, "expected separator in dict");
-                goto out;
-            }
+GVariant *json_parser_parse_literal(JSONToken *token)
+{
+    return token_to_literal(token);
+}
+
+/**
+ * Parser
+ *
+ * The parser is driven by the caller one token at a time.  Instead of
+ * recursing, it remembers the open containers in a stack and what it
+ * expects to see next in STATE, so the nesting depth is only limited by
+ * memory.  Values go straight into a single JSONBuilder, so tokens need
+ * not outlive the call that feeds them.
+ */
+enum {
+    JSON_PARSER_VALUE,
+    JSON_PARSER_VALUE_OR_CLOSE,
+    JSON_PARSER_KEY,
+    JSON_PARSER_KEY_OR_CLOSE,
+    JSON_PARSER_COLON,
+    JSON_PARSER_NEXT,
+    JSON_PARSER_SKIP,
+};
+
+/*
+ * A rough estimate of what a GVariant costs in the builder, on top of
+ * the text of its token.  Only used to enforce max_memory.
+ */
+#define JSON_PARSER_VALUE_SIZE 64
+
+static const char *const json_limit_names[] = {
+    [JSON_LIMIT_DEPTH] = "depth",
+    [JSON_LIMIT_TOKENS] = "number of tokens",
+    [JSON_LIMIT_BYTES] = "size",
+    [JSON_LIMIT_MEMORY] = "memory",
+};
+
+const char *json_limit_name(JSONLimit limit)
+{
+    return json_limit_names[limit];
+}
+
+/*
+ * Return the character of an operator, or the type of any other token.
+ * No operator character is also a token type, so the parser can
+ * dispatch on a token with a single switch.
+ */
+#define JSON_IS_TOKEN_TYPE(c) ((c) >= JSON_OPERATOR && (c) <= JSON_SKIP)
+G_STATIC_ASSERT(!JSON_IS_TOKEN_TYPE('{') && !JSON_IS_TOKEN_TYPE('}') &&
+                !JSON_IS_TOKEN_TYPE('[') && !JSON_IS_TOKEN_TYPE(']') &&
+                !JSON_IS_TOKEN_TYPE(',') && !JSON_IS_TOKEN_TYPE(':'));
+
+static int token_kind(const JSONToken *token)
+{
+    return token->type == JSON_OPERATOR ? token->str[0] : token->type;
+}
 
-            g_queue_pop_head (tokens);
+/* Convert a token that is a value on its own, or return NULL.  */
+static GVariant *token_to_value(const JSONToken *token, va_list *ap)
+{
+    switch (token->type) {
+    case JSON_ESCAPE:
+        if (!ap) {
+            return NULL;
         }
+        return json_parser_escape_value(json_parser_escape_kind(token), ap);
+    case JSON_KEYWORD:
+        return token_to_keyword(token);
+    case JSON_STRING:
+    case JSON_INTEGER:
+    case JSON_FLOAT:
+        return token_to_literal(token);
+    default:
+        return NULL;
     }
+}
 
-    g_queue_pop_head (tokens);
-    return g_variant_builder_end (&builder);
+/*
+ * Convert a scalar token.  While recording a template, an escape
+ * becomes a hole instead of taking its argument.
+ */
+static GVariant *json_parser_scalar(JSONParser *parser,
+                                    const JSONToken *token)
+{
+    JSONEscape kind;
 
-out:
-    g_variant_builder_clear (&builder);
-out_not_object:
-    return NULL;
+    if (parser->recording && token->type == JSON_ESCAPE) {
+        kind = json_parser_escape_kind(token);
+        return kind ? g_variant_new_handle(kind) : NULL;
+    }
+    return token_to_value(token, parser->ap);
+}
+
+/* Only %s holes can be keys.  */
+static bool json_parser_is_key(JSONParser *parser, GVariant *value)
+{
+    if (parser->recording &&
+        g_variant_is_of_type(value, G_VARIANT_TYPE_HANDLE)) {
+        return g_variant_get_handle(value) == JSON_ESCAPE_STRING;
+    }
+    return g_variant_is_of_type(value, G_VARIANT_TYPE_STRING);
+}
+
+void json_parser_init(JSONParser *parser, va_list *ap)
+{
+    parser->ap = ap;
+    parser->state = JSON_PARSER_VALUE;
+    parser->stack = g_string_new(NULL);
+    json_builder_init(&parser->builder);
+    parser->schema = NULL;
+    parser->key = NULL;
+    memset(&parser->limits, 0, sizeof(parser->limits));
+    parser->limit = JSON_LIMIT_NONE;
+    parser->n_tokens = 0;
+    parser->start = 0;
+    parser->memory = 0;
+    parser->skip = 0;
+    parser->split_depth = 0;
+    parser->split_key = NULL;
+    parser->recording = NULL;
 }
 
-static GVariant *parse_array(JSONParserContext *ctxt, GQueue *tokens, va_list *ap)
+void json_parser_set_split_depth(JSONParser *parser, size_t depth)
 {
-    static GVariantType *BOXED_ARRAY;
-    GVariantBuilder builder;
-    JSONToken *peek;
+    parser->split_depth = depth;
+}
+
+void json_parser_set_schema(JSONParser *parser, const JSONSchema *schema)
+{
+    parser->schema = schema;
+    json_schema_builder_init(&parser->typed, schema);
+}
 
-    peek = g_queue_peek_head (tokens);
-    if (!token_is_operator(peek, '[')) {
-        goto out_not_array;
+void json_parser_set_template(JSONParser *parser, JSONTemplate *template)
+{
+    parser->recording = template;
+}
+
+void json_parser_set_infer_arrays(JSONParser *parser, bool infer)
+{
+    json_builder_set_infer_arrays(&parser->builder, infer);
+}
+
+void json_parser_set_limits(JSONParser *parser, const JSONLimits *limits)
+{
+    parser->limits = *limits;
+}
+
+static JSONLimit json_parser_check_limits(JSONParser *parser,
+                                          size_t bytes, size_t memory)
+{
+    const JSONLimits *limits = &parser->limits;
+
+    if (limits->max_tokens && parser->n_tokens > limits->max_tokens) {
+        return JSON_LIMIT_TOKENS;
+    }
+    if (limits->max_bytes && bytes > limits->max_bytes) {
+        return JSON_LIMIT_BYTES;
     }
+    if (limits->max_memory && memory > limits->max_memory) {
+        return JSON_LIMIT_MEMORY;
+    }
+    return JSON_LIMIT_NONE;
+}
 
-    g_queue_pop_head (tokens);
-    peek = g_queue_peek_head (tokens);
-    if (!BOXED_ARRAY) {
-        BOXED_ARRAY = g_variant_type_new ("av");
+/*
+ * The outermost SPLIT_DEPTH containers are not built; their children
+ * are returned one by one instead.  The builder holds the containers
+ * below them.
+ */
+static bool json_parser_is_split(JSONParser *parser, size_t depth)
+{
+    return depth <= parser->split_depth;
+}
+
+/* Return the element VALUE of a split container, with its key if any.  */
+static GVariant *json_parser_split_element(GVariant *key, GVariant *value)
+{
+    if (!key) {
+        return value;
     }
-    g_variant_builder_init (&builder, BOXED_ARRAY);
-    if (!token_is_operator(peek, ']')) {
-        for (;;) {
-	    GVariant *obj = parse_value(ctxt, tokens, ap);
-            if (obj == NULL) {
-                goto out;
-            }
+    return g_variant_new_dict_entry(key, g_variant_new_variant(value));
+}
 
-            g_variant_builder_add_value (&builder, g_variant_new_variant (obj));
-            peek = g_queue_peek_head (tokens);
-            if (token_is_operator(peek, ']')) {
-                break;
-            }
-            if (!token_is_operator(peek, ',')) {
-                parse_error(ctxt, peek, "expected separator in array");
-                goto out;
-            }
+/*
+ * Free the partial value and skip the rest of it, which is as deep as
+ * the containers that are open, except for the outermost KEEP.
+ */
+static void json_parser_reject(JSONParser *parser, JSONLimit limit,
+                               size_t keep)
+{
+    if (parser->key) {
+        g_variant_unref(parser->key);
+        parser->key = NULL;
+    }
+    if (parser->split_key) {
+        g_variant_unref(parser->split_key);
+        parser->split_key = NULL;
+    }
+    json_builder_clear(&parser->builder);
+    if (parser->schema) {
+        json_schema_builder_clear(&parser->typed);
+    }
+    parser->skip = parser->stack->len - keep;
+    g_string_truncate(parser->stack, keep);
+    parser->limit = limit;
+    parser->state = JSON_PARSER_SKIP;
+    parser->n_tokens = 0;
+    parser->memory = 0;
+}
 
-            g_queue_pop_head (tokens);
+/* Drop TOKEN, and stop skipping once the rejected value is closed.  */
+static void json_parser_skip(JSONParser *parser, const JSONToken *token)
+{
+    switch (token_kind(token)) {
+    case '{':
+    case '[':
+        parser->skip++;
+        break;
+    case '}':
+    case ']':
+        if (parser->skip) {
+            parser->skip--;
         }
+        break;
     }
+    if (!parser->skip) {
+        /* Go on with the next element of a split container, if any.  */
+        parser->state = parser->stack->len ? JSON_PARSER_NEXT
+                                           : JSON_PARSER_VALUE;
+        parser->n_tokens = 0;
+        parser->memory = 0;
+    }
+}
 
-    g_queue_pop_head (tokens);
-    return g_variant_builder_end(&builder);
+/* Return false if the container does not fit the schema.  */
+static bool json_parser_open(JSONParser *parser, char c)
+{
+    size_t depth = parser->stack->len;
+    GVariant *key = parser->key;
 
-out:
-    g_variant_builder_clear(&builder);
-out_not_array:
-    return NULL;
+    parser->key = NULL;
+    if (parser->schema) {
+        if (!json_schema_builder_open(&parser->typed, key, c)) {
+            return false;
+        }
+    } else if (parser->recording) {
+        json_template_open(parser->recording, key, c);
+    } else if (json_parser_is_split(parser, depth + 1)) {
+        /* Only the key of the innermost split container is kept.  */
+        if (key) {
+            g_variant_unref(key);
+        }
+        /* The first element starts after the bracket.  */
+        parser->n_tokens = 0;
+        parser->memory = 0;
+    } else if (json_parser_is_split(parser, depth)) {
+        json_builder_open(&parser->builder, NULL, c);
+        parser->split_key = key;
+    } else {
+        json_builder_open(&parser->builder, key, c);
+    }
+    g_string_append_c(parser->stack, c);
+    parser->state = (c == '{') ? JSON_PARSER_KEY_OR_CLOSE
+                               : JSON_PARSER_VALUE_OR_CLOSE;
+    return true;
 }
 
-static GVariant *parse_keyword(JSONParserContext *ctxt, GQueue *tokens)
+/*
+ * Store in *RESULT the container that was closed if it is complete:
+ * either it is the top-level value, or an element of a split container.
+ * Return false if the container does not fit the schema.
+ */
+static bool json_parser_close(JSONParser *parser, GVariant **result)
 {
-    GVariant *ret;
-    JSONToken *token;
+    GVariant *value, *key;
+    size_t depth;
 
-    token = g_queue_peek_head(tokens);
-    if (token->type != JSON_KEYWORD) {
-        goto out;
+    *result = NULL;
+    if (parser->schema &&
+        !json_schema_builder_close(&parser->typed, result)) {
+        return false;
     }
-
-    if (token_is_keyword(token, "true")) {
-        ret = g_variant_new_boolean(TRUE);
-    } else if (token_is_keyword(token, "false")) {
-        ret = g_variant_new_boolean(FALSE);
-    } else {
-        parse_error(ctxt, token, "invalid keyword `%s'", token->str);
-        goto out;
+    if (parser->recording) {
+        json_template_close(parser->recording);
     }
 
-    g_queue_pop_head(tokens);
-    return ret;
+    g_string_truncate(parser->stack, parser->stack->len - 1);
+    depth = parser->stack->len;
+    parser->state = JSON_PARSER_NEXT;
+    if (parser->schema || parser->recording ||
+        json_parser_is_split(parser, depth + 1)) {
+        return true;
+    }
 
-out: 
-    return NULL;
+    value = json_builder_close(&parser->builder);
+    if (value) {
+        key = parser->split_key;
+        parser->split_key = NULL;
+        *result = json_parser_split_element(key, value);
+    }
+    return true;
 }
 
-static GVariant *parse_escape(JSONParserContext *ctxt, GQueue *tokens, va_list *ap)
+/*
+ * Store VALUE in *RESULT if it is complete, possibly as an element of
+ * a split container, or add it to the innermost container.  Return
+ * false if the value does not fit the schema.
+ */
+static bool json_parser_add(JSONParser *parser, GVariant *value,
+                            GVariant **result)
 {
-    GVariant *obj;
-    JSONToken *token;
-
-    if (ap == NULL) {
-        goto out;
-    }
-
-    token = g_queue_peek_head(tokens);
-    if (token_is_escape(token, "%p")) {
-        obj = va_arg(*ap, GVariant *);
-    } else if (token_is_escape(token, "%i")) {
-        obj = g_variant_new_boolean(va_arg(*ap, int));
-    } else if (token_is_escape(token, "%d")) {
-        obj = g_variant_new_int64(va_arg(*ap, int));
-    } else if (token_is_escape(token, "%ld")) {
-        obj = g_variant_new_int64(va_arg(*ap, long));
-    } else if (token_is_escape(token, "%lld") ||
-               token_is_escape(token, "%I64d")) {
-        obj = g_variant_new_int64(va_arg(*ap, long long));
-    } else if (token_is_escape(token, "%s")) {
-        obj = g_variant_new_string(va_arg(*ap, const char *));
-    } else if (token_is_escape(token, "%f")) {
-        obj = g_variant_new_double(va_arg(*ap, double));
-    } else {
-        goto out;
-    }
+    GVariant *key = parser->key;
 
-    g_queue_pop_head(tokens);
-    return obj;
+    parser->key = NULL;
+    parser->state = JSON_PARSER_NEXT;
+    *result = NULL;
+    if (parser->schema) {
+        return json_schema_builder_add(&parser->typed, key, value, result);
+    }
+    if (parser->recording) {
+        json_template_add(parser->recording, key, value);
+        return true;
+    }
+    if (json_parser_is_split(parser, parser->stack->len)) {
+        *result = json_parser_split_element(key, value);
+        return true;
+    }
 
-out:
-    return NULL;
+    json_builder_add(&parser->builder, key, value);
+    return true;
 }
 
-static GVariant *parse_literal(JSONParserContext *ctxt, GQueue *tokens)
+int json_parser_feed(JSONParser *parser, const JSONToken *token,
+                     GVariant **result)
 {
-    GVariant *obj;
-    JSONToken *token;
+    GVariant *value;
+    JSONLimit limit;
+    char top;
+    int kind;
 
-    token = g_queue_peek_head(tokens);
-    switch (token->type) {
-    case JSON_STRING:
-        obj = g_variant_from_escaped_str(ctxt, token);
-        break;
-    case JSON_INTEGER:
-        obj = g_variant_new_int64(strtoll(token->str, NULL, 10));
-        break;
-    case JSON_FLOAT:
-        /* FIXME dependent on locale */
-        obj = g_variant_new_double(strtod(token->str, NULL));
+    if (parser->state == JSON_PARSER_SKIP) {
+        json_parser_skip(parser, token);
+        return 0;
+    }
+
+    if (!parser->n_tokens) {
+        parser->start = json_token_end(token) - token->len;
+        parser->limit = JSON_LIMIT_NONE;
+    }
+    parser->n_tokens++;
+    parser->memory += token->len;
+    kind = token_kind(token);
+    if (token->type != JSON_OPERATOR || kind == '{' || kind == '[') {
+        parser->memory += JSON_PARSER_VALUE_SIZE;
+    }
+    limit = json_parser_check_limits(parser,
+                                     json_token_end(token) - parser->start,
+                                     parser->memory);
+    if (limit) {
+        goto reject;
+    }
+
+    switch (kind) {
+    case '{':
+    case '[':
+        if (parser->state != JSON_PARSER_VALUE &&
+            parser->state != JSON_PARSER_VALUE_OR_CLOSE) {
+            goto unexpected;
+        }
+        if (parser->limits.max_depth &&
+            parser->stack->len >= parser->limits.max_depth) {
+            limit = JSON_LIMIT_DEPTH;
+            goto reject;
+        }
+        if (!json_parser_open(parser, kind)) {
+            goto mismatch;
+        }
+        return 0;
+
+    case '}':
+    case ']':
+        if (parser->state == JSON_PARSER_NEXT
+            ? kind != parser->stack->str[parser->stack->len - 1] + 2
+            : parser->state != (kind == '}' ? JSON_PARSER_KEY_OR_CLOSE
+                                            : JSON_PARSER_VALUE_OR_CLOSE)) {
+            goto unexpected;
+        }
+        goto close;
+
+    case ',':
+        if (parser->state != JSON_PARSER_NEXT) {
+            goto unexpected;
+        }
+        top = parser->stack->str[parser->stack->len - 1];
+        parser->state = (top == '{') ? JSON_PARSER_KEY : JSON_PARSER_VALUE;
+        if (json_parser_is_split(parser, parser->stack->len)) {
+            /* The next element starts after the comma.  */
+            parser->n_tokens = 0;
+            parser->memory = 0;
+        }
+        return 0;
+
+    case ':':
+        if (parser->state != JSON_PARSER_COLON) {
+            goto unexpected;
+        }
+        parser->state = JSON_PARSER_VALUE;
+        return 0;
+
+    default:
         break;
+    }
+
+    /* Everything else is a scalar, which is either a key or a value.  */
+    switch (parser->state) {
+    case JSON_PARSER_KEY_OR_CLOSE:
+    case JSON_PARSER_KEY:
+        value = json_parser_scalar(parser, token);
+        if (!value || !json_parser_is_key(parser, value)) {
+            if (value) {
+                g_variant_unref(value);
+            }
+            goto unexpected;
+        }
+        parser->key = value;
+        parser->state = JSON_PARSER_COLON;
+        return 0;
+
+    case JSON_PARSER_VALUE_OR_CLOSE:
+    case JSON_PARSER_VALUE:
+        value = json_parser_scalar(parser, token);
+        if (!value) {
+            goto unexpected;
+        }
+        if (!json_parser_add(parser, value, result)) {
+            goto mismatch;
+        }
+        goto done;
+
     default:
-        goto out;
+        goto unexpected;
     }
 
-    g_queue_pop_head(tokens);
-    return obj;
+close:
+    if (!json_parser_close(parser, result)) {
+        goto mismatch;
+    }
 
-out:
-    return NULL;
+done:
+    if (!parser->stack->len) {
+        /* The top-level value is complete.  */
+        parser->state = JSON_PARSER_VALUE;
+    } else if (*result == NULL) {
+        return 0;
+    }
+    parser->n_tokens = 0;
+    parser->memory = 0;
+    return *result != NULL;
+
+unexpected:
+    switch (parser->state) {
+    case JSON_PARSER_KEY_OR_CLOSE:
+    case JSON_PARSER_KEY:
+        parse_error(token, "key is not a string in object");
+        break;
+    case JSON_PARSER_COLON:
+        parse_error(token, "missing : in object pair");
+        break;
+    case JSON_PARSER_NEXT:
+        top = parser->stack->str[parser->stack->len - 1];
+        parse_error(token, top == '{' ? "expected separator in dict"
+                                      : "expected separator in array");
+        break;
+    default:
+        parse_error(token, parser->key ? "Missing value in dict"
+                                       : "expected value");
+        break;
+    }
+    goto error;
+
+mismatch:
+    parse_error(token, "%s", parser->typed.error);
+    goto error;
+
+reject:
+    parse_error(token, "value exceeds the maximum %s",
+                json_limit_name(limit));
+error:
+    /*
+     * Report the error now, and drop the rest of the value silently.
+     * Split containers are kept, so only the bad element is lost.
+     */
+    json_parser_reject(parser, limit,
+                       MIN(parser->stack->len, parser->split_depth));
+    json_parser_skip(parser, token);
+    *result = NULL;
+    return 1;
 }
 
-static GVariant *parse_value(JSONParserContext *ctxt, GQueue *tokens, va_list *ap)
+int json_parser_feed_partial(JSONParser *parser, size_t end, size_t len,
+                             GVariant **result)
 {
-    GVariant *obj;
+    JSONLimit limit;
+    size_t start;
 
-    obj = parse_object(ctxt, tokens, ap);
-    if (obj == NULL) {
-        obj = parse_array(ctxt, tokens, ap);
+    if (parser->state == JSON_PARSER_SKIP || !len) {
+        return 0;
     }
-    if (obj == NULL) {
-        obj = parse_escape(ctxt, tokens, ap);
+
+    start = parser->n_tokens ? parser->start : end - len;
+    limit = json_parser_check_limits(parser, end - start,
+                                     parser->memory + len);
+    if (!limit) {
+        return 0;
     }
-    if (obj == NULL) {
-        obj = parse_keyword(ctxt, tokens);
-    } 
-    if (obj == NULL) {
-        obj = parse_literal(ctxt, tokens);
+
+    parse_error(NULL, "value exceeds the maximum %s",
+                json_limit_name(limit));
+    json_parser_reject(parser, limit,
+                       MIN(parser->stack->len, parser->split_depth));
+    *result = NULL;
+    return 1;
+}
+
+void json_parser_reset(JSONParser *parser)
+{
+    json_parser_reject(parser, JSON_LIMIT_NONE, 0);
+    parser->state = JSON_PARSER_VALUE;
+    parser->skip = 0;
+    parser->n_tokens = 0;
+    parser->memory = 0;
+}
+
+bool json_parser_is_skipping(const JSONParser *parser)
+{
+    return parser->state == JSON_PARSER_SKIP;
+}
+
+int json_parser_end(JSONParser *parser, bool truncated, GVariant **result)
+{
+    bool skipping = json_parser_is_skipping(parser);
+    bool pending = (parser->n_tokens || parser->stack->len) && !skipping;
+
+    json_parser_reset(parser);
+    if (skipping || !(pending || truncated)) {
+        return 0;
     }
 
-    return obj;
+    parse_error(NULL, "unexpected end of input");
+    *result = NULL;
+    return 1;
 }
 
-GVariant *json_parser_parse(GQueue *tokens, va_list *ap)
+void json_parser_destroy(JSONParser *parser)
 {
-    JSONParserContext ctxt = {};
-    GQueue *working;
-    GVariant *result;
+    json_parser_reject(parser, JSON_LIMIT_NONE, 0);
+    json_builder_destroy(&parser->builder);
+    if (parser->schema) {
+        json_schema_builder_destroy(&parser->typed);
+    }
+    g_string_free(parser->stack, TRUE);
+}
 
-    if (!tokens)
-	return NULL;
+GVariant *json_parser_parse(GArray *tokens, va_list *ap)
+{
+    JSONParser parser;
+    GVariant *result = NULL;
+    guint i;
 
-    working = g_queue_copy(tokens);
-    result = parse_value(&ctxt, working, ap);
-    g_queue_free(working);
+    if (!tokens || !tokens->len) {
+        return NULL;
+    }
 
+    /* Stop at the first value, like the streamer does.  */
+    json_parser_init(&parser, ap);
+    for (i = 0; i < tokens->len; i++) {
+        if (json_parser_feed(&parser, &g_array_index(tokens, JSONToken, i),
+                             &result)) {
+            break;
+        }
+    }
+    if (i == tokens->len) {
+        json_parser_end(&parser, false, &result);
+    }
+    json_parser_destroy(&parser);
     return result;
 }
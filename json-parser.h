@@ -17,7 +17,163 @@
 #define QEMU_JSON_PARSER_H
 
 #include <glib.h>
+#include "json-builder.h"
+#include "json-lexer.h"
+#include "json-schema.h"
+#include "json-template.h"
 
-GVariant *json_parser_parse(GQueue *tokens, va_list *ap);
+/* TOKENS is an array of JSONToken, such as the one json-streamer.c emits.  */
+GVariant *json_parser_parse(GArray *tokens, va_list *ap);
+
+/* Convert a JSON_STRING, JSON_INTEGER or JSON_FLOAT token.  */
+GVariant *json_parser_parse_literal(JSONToken *token);
+
+/* The %-escapes of g_variant_from_jsonf.  */
+typedef enum JSONEscape
+{
+    JSON_ESCAPE_NONE,
+    /* %p, a GVariant.  */
+    JSON_ESCAPE_VARIANT,
+    /* %i, a boolean passed as an int.  */
+    JSON_ESCAPE_BOOLEAN,
+    /* %d, %ld, and %lld or %I64d.  */
+    JSON_ESCAPE_INT,
+    JSON_ESCAPE_LONG,
+    JSON_ESCAPE_LONG_LONG,
+    /* %s and %f.  */
+    JSON_ESCAPE_STRING,
+    JSON_ESCAPE_DOUBLE,
+} JSONEscape;
+
+/* Return JSON_ESCAPE_NONE if TOKEN is not an escape that is known.  */
+JSONEscape json_parser_escape_kind(const JSONToken *token);
+
+/* Take the argument of an escape of KIND from AP.  */
+GVariant *json_parser_escape_value(JSONEscape kind, va_list *ap);
+
+/* Limits on a single value.  Zero means no limit.  */
+typedef struct JSONLimits
+{
+    /* Containers open at the same time.  */
+    size_t max_depth;
+    size_t max_tokens;
+    /* Length of the text, from the first token to the last.  */
+    size_t max_bytes;
+    /* An estimate of the memory taken by the value while it is built.  */
+    size_t max_memory;
+} JSONLimits;
+
+typedef enum JSONLimit
+{
+    JSON_LIMIT_NONE,
+    JSON_LIMIT_DEPTH,
+    JSON_LIMIT_TOKENS,
+    JSON_LIMIT_BYTES,
+    JSON_LIMIT_MEMORY,
+} JSONLimit;
+
+/* For example "depth" for JSON_LIMIT_DEPTH.  */
+const char *json_limit_name(JSONLimit limit);
+
+/*
+ * An incremental parser, fed one token at a time as the lexer produces
+ * them.  It does not keep the tokens; its memory is proportional to the
+ * nesting depth, besides the partially built value.
+ */
+typedef struct JSONParser
+{
+    va_list *ap;
+    int state;
+    /* '{' or '[' for each container that is still open.  */
+    GString *stack;
+    JSONBuilder builder;
+    GVariant *key;
+    JSONLimits limits;
+    /* The limit that the last rejected value exceeded, if any.  */
+    JSONLimit limit;
+    /* Accounting for the value being parsed.  */
+    size_t n_tokens;
+    size_t start;
+    size_t memory;
+    /* Depth of the rejected value that is being skipped.  */
+    size_t skip;
+    size_t split_depth;
+    GVariant *split_key;
+    const JSONSchema *schema;
+    JSONSchemaBuilder typed;
+    JSONTemplate *recording;
+} JSONParser;
+
+void json_parser_init(JSONParser *parser, va_list *ap);
+
+/*
+ * Return the values inside DEPTH levels of containers one by one, as
+ * soon as each is complete, instead of building the containers around
+ * them.  Object members come back as a {sv} dictionary entry.  Each
+ * value is subject to the limits on its own.  A syntax error only
+ * loses the element that contains it.
+ */
+void json_parser_set_split_depth(JSONParser *parser, size_t depth);
+
+/*
+ * Build values of the type of SCHEMA, and reject those that do not fit
+ * it.  SCHEMA must outlive the parser.  It cannot be combined with a
+ * split depth.
+ */
+void json_parser_set_schema(JSONParser *parser, const JSONSchema *schema);
+
+/*
+ * Record the values into TEMPLATE instead of building them, with a
+ * hole for each escape.  It cannot be combined with a schema or a
+ * split depth.
+ */
+void json_parser_set_template(JSONParser *parser, JSONTemplate *template);
+
+/*
+ * Build arrays whose elements all have the same type as arrays of that
+ * type, as with json_builder_set_infer_arrays.
+ */
+void json_parser_set_infer_arrays(JSONParser *parser, bool infer);
+
+void json_parser_set_limits(JSONParser *parser, const JSONLimits *limits);
+
+/*
+ * Return 0 if TOKEN did not complete a value (or, when splitting, an
+ * element).  Otherwise return 1 and
+ * store the value in *RESULT, or NULL if the value had a syntax error
+ * or exceeded a limit.  Errors are reported as soon as they are found;
+ * the rest of the bad value is then dropped, up to the bracket that
+ * closes it.
+ */
+int json_parser_feed(JSONParser *parser, const JSONToken *token,
+                     GVariant **result);
+
+/*
+ * Check the limits against a token that the lexer has not finished:
+ * LEN bytes of it have been read, up to stream offset END.  Return 1
+ * and store NULL in *RESULT if the value is rejected; the token is then
+ * dropped when it is eventually fed.
+ */
+int json_parser_feed_partial(JSONParser *parser, size_t end, size_t len,
+                             GVariant **result);
+
+/*
+ * Tell the parser that the input ended.  TRUNCATED means that it ended
+ * in the middle of a token, or with a lexical error.  Return 1 and
+ * store NULL in *RESULT if this leaves a value incomplete and its error
+ * was not reported yet.  Either way, the next token starts a new value.
+ */
+int json_parser_end(JSONParser *parser, bool truncated, GVariant **result);
+
+/* Drop the value being parsed, if any, without reporting it.  */
+void json_parser_reset(JSONParser *parser);
+
+/*
+ * Return whether the value being parsed was already reported as NULL,
+ * and the rest of it is being skipped.
+ */
+bool json_parser_is_skipping(const JSONParser *parser);
+
+void json_parser_destroy(JSONParser *parser);
 
 #endif
@@ -0,0 +1,613 @@
+/*
+ * Schema-directed JSON values
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * Containers are collected in a GPtrArray each, and built when they are
+ * closed: members of tuples can come in any order, and the fixed-size
+ * types of the schema leave nothing to gain from writing serialized
+ * data directly.  Containers inside a v go to a JSONBuilder instead.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "json-schema.h"
+
+struct JSONSchema
+{
+    GVariantType *type;
+    /*
+     * The members of a tuple or dictionary entry, or the element of an
+     * array or maybe.
+     */
+    JSONSchema **members;
+    guint n_members;
+    /* For tuples that are filled from objects, the name of each member.  */
+    char **names;
+};
+
+typedef struct JSONSchemaFrame
+{
+    /* The schema of the container, and the maybes around it if any.  */
+    const JSONSchema *schema;
+    const JSONSchema *expected;
+    /* The elements, or the members of a tuple in the order of the schema.  */
+    GPtrArray *values;
+    /* Where the container goes in its parent.  */
+    GVariant *key;
+    guint slot;
+} JSONSchemaFrame;
+
+static char json_schema_kind(const JSONSchema *schema)
+{
+    return *g_variant_type_peek_string(schema->type);
+}
+
+static bool json_schema_is_name(char c)
+{
+    return g_ascii_isalnum(c) || c == '_' || c == '-';
+}
+
+/*
+ * Parse the type at *P, and append it to TYPE without the names.  The
+ * recursion is as deep as the schema, which comes from the program.
+ */
+static JSONSchema *json_schema_parse(const char **p, GString *type,
+                                     bool in_array)
+{
+    JSONSchema *schema = g_new0(JSONSchema, 1), *member;
+    GPtrArray *members, *names = NULL;
+    size_t start = type->len;
+    const char *q;
+    char c = **p, *name;
+    guint i;
+
+    members = g_ptr_array_new_with_free_func((GDestroyNotify)
+                                             json_schema_free);
+    if (!c) {
+        goto fail;
+    }
+    (*p)++;
+    g_string_append_c(type, c);
+    switch (c) {
+    case 'b': case 'y': case 'n': case 'q': case 'i': case 'u':
+    case 'x': case 't': case 'd': case 's': case 'o': case 'g':
+    case 'v':
+        break;
+
+    case 'a':
+    case 'm':
+        member = json_schema_parse(p, type, c == 'a');
+        if (!member) {
+            goto fail;
+        }
+        g_ptr_array_add(members, member);
+        break;
+
+    case '{':
+        if (!in_array || !**p || !strchr("sog", **p)) {
+            goto fail;
+        }
+        g_ptr_array_add(members, json_schema_parse(p, type, false));
+        member = json_schema_parse(p, type, false);
+        if (!member || **p != '}') {
+            if (member) {
+                json_schema_free(member);
+            }
+            goto fail;
+        }
+        g_ptr_array_add(members, member);
+        g_string_append_c(type, *(*p)++);
+        break;
+
+    case '(':
+        for (;;) {
+            while (**p == ' ') {
+                (*p)++;
+            }
+            if (**p == ')') {
+                break;
+            }
+
+            /* Either all members have a name, or none has.  */
+            for (q = *p; json_schema_is_name(*q); q++) {
+                continue;
+            }
+            if (q != *p && *q == ':') {
+                if (!names) {
+                    if (members->len) {
+                        goto fail;
+                    }
+                    names = g_ptr_array_new_with_free_func(g_free);
+                }
+                name = g_strndup(*p, q - *p);
+                g_ptr_array_add(names, name);
+                for (i = 0; i < names->len - 1; i++) {
+                    if (!strcmp(g_ptr_array_index(names, i), name)) {
+                        goto fail;
+                    }
+                }
+                *p = q + 1;
+            } else if (names) {
+                goto fail;
+            }
+
+            member = json_schema_parse(p, type, false);
+            if (!member) {
+                goto fail;
+            }
+            g_ptr_array_add(members, member);
+        }
+        g_string_append_c(type, *(*p)++);
+        break;
+
+    default:
+        goto fail;
+    }
+
+    schema->type = g_variant_type_copy((const GVariantType *)
+                                       (type->str + start));
+    schema->n_members = members->len;
+    schema->members = (JSONSchema **) g_ptr_array_free(members, FALSE);
+    if (names) {
+        g_ptr_array_add(names, NULL);
+        schema->names = (char **) g_ptr_array_free(names, FALSE);
+    }
+    return schema;
+
+fail:
+    g_ptr_array_free(members, TRUE);
+    if (names) {
+        g_ptr_array_free(names, TRUE);
+    }
+    g_free(schema);
+    return NULL;
+}
+
+JSONSchema *json_schema_new(const char *string)
+{
+    GString *type = g_string_new(NULL);
+    JSONSchema *schema;
+
+    schema = json_schema_parse(&string, type, false);
+    if (schema && *string) {
+        json_schema_free(schema);
+        schema = NULL;
+    }
+    g_string_free(type, TRUE);
+    return schema;
+}
+
+const GVariantType *json_schema_get_type(const JSONSchema *schema)
+{
+    return schema->type;
+}
+
+void json_schema_free(JSONSchema *schema)
+{
+    guint i;
+
+    for (i = 0; i < schema->n_members; i++) {
+        json_schema_free(schema->members[i]);
+    }
+    g_free(schema->members);
+    g_strfreev(schema->names);
+    g_variant_type_free(schema->type);
+    g_free(schema);
+}
+
+/* Return SCHEMA without the maybes around it.  */
+static const JSONSchema *json_schema_unwrap(const JSONSchema *schema)
+{
+    while (json_schema_kind(schema) == 'm') {
+        schema = schema->members[0];
+    }
+    return schema;
+}
+
+/* Put VALUE, whose schema is unwrapped from EXPECTED, in the maybes.  */
+static GVariant *json_schema_wrap(const JSONSchema *expected, GVariant *value)
+{
+    const JSONSchema *schema = json_schema_unwrap(expected);
+    guint n = 0;
+
+    for (; expected != schema; expected = expected->members[0]) {
+        n++;
+    }
+    while (n--) {
+        value = g_variant_new_maybe(NULL, value);
+    }
+    return value;
+}
+
+/*
+ * Convert VALUE, a scalar as the parser returns it, to the type of
+ * SCHEMA.  VALUE is consumed; return NULL if it does not fit.
+ */
+static GVariant *json_schema_convert(const JSONSchema *schema, GVariant *value)
+{
+    GVariant *result = NULL;
+    const char *str = NULL;
+    gint64 n = 0;
+
+    switch (json_schema_kind(schema)) {
+    case 'v':
+        return g_variant_new_variant(value);
+    case 'm':
+        result = json_schema_convert(schema->members[0], value);
+        return result ? g_variant_new_maybe(NULL, result) : NULL;
+    }
+
+    if (g_variant_is_of_type(value, schema->type)) {
+        return value;
+    }
+
+    if (g_variant_is_of_type(value, G_VARIANT_TYPE_INT64)) {
+        n = g_variant_get_int64(value);
+        switch (json_schema_kind(schema)) {
+        case 'y':
+            if (n >= 0 && n <= G_MAXUINT8) {
+                result = g_variant_new_byte(n);
+            }
+            break;
+        case 'n':
+            if (n >= G_MININT16 && n <= G_MAXINT16) {
+                result = g_variant_new_int16(n);
+            }
+            break;
+        case 'q':
+            if (n >= 0 && n <= G_MAXUINT16) {
+                result = g_variant_new_uint16(n);
+            }
+            break;
+        case 'i':
+            if (n >= G_MININT32 && n <= G_MAXINT32) {
+                result = g_variant_new_int32(n);
+            }
+            break;
+        case 'u':
+            if (n >= 0 && n <= G_MAXUINT32) {
+                result = g_variant_new_uint32(n);
+            }
+            break;
+        case 't':
+            if (n >= 0) {
+                result = g_variant_new_uint64(n);
+            }
+            break;
+        case 'd':
+            result = g_variant_new_double(n);
+            break;
+        }
+    } else if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING)) {
+        str = g_variant_get_string(value, NULL);
+        switch (json_schema_kind(schema)) {
+        case 'o':
+            if (g_variant_is_object_path(str)) {
+                result = g_variant_new_object_path(str);
+            }
+            break;
+        case 'g':
+            if (g_variant_is_signature(str)) {
+                result = g_variant_new_signature(str);
+            }
+            break;
+        }
+    }
+    g_variant_unref(g_variant_ref_sink(value));
+    return result;
+}
+
+static void json_schema_value_free(gpointer value)
+{
+    if (value) {
+        g_variant_unref(value);
+    }
+}
+
+static bool json_schema_error(JSONSchemaBuilder *builder,
+                              const char *msg, ...)
+{
+    va_list ap;
+
+    g_free(builder->error);
+    va_start(ap, msg);
+    builder->error = g_strdup_vprintf(msg, ap);
+    va_end(ap);
+    return false;
+}
+
+static bool json_schema_mismatch(JSONSchemaBuilder *builder,
+                                 const JSONSchema *schema)
+{
+    char *type = g_variant_type_dup_string(schema->type);
+
+    json_schema_error(builder, "value does not match type `%s'", type);
+    g_free(type);
+    return false;
+}
+
+void json_schema_builder_init(JSONSchemaBuilder *builder,
+                              const JSONSchema *schema)
+{
+    builder->schema = schema;
+    builder->frames = g_array_new(FALSE, FALSE, sizeof(JSONSchemaFrame));
+    json_builder_init(&builder->untyped);
+    builder->error = NULL;
+}
+
+static JSONSchemaFrame *json_schema_builder_top(JSONSchemaBuilder *builder)
+{
+    if (!builder->frames->len) {
+        return NULL;
+    }
+    return &g_array_index(builder->frames, JSONSchemaFrame,
+                          builder->frames->len - 1);
+}
+
+/* Whether the innermost container is inside a v.  */
+static bool json_schema_builder_untyped(JSONSchemaBuilder *builder)
+{
+    JSONSchemaFrame *frame = json_schema_builder_top(builder);
+
+    return frame && json_schema_kind(frame->schema) == 'v';
+}
+
+/*
+ * Return the schema of the next value of the innermost container, and
+ * where the value goes: the key of its dictionary entry in *ENTRY_KEY,
+ * or its member in *SLOT.  KEY is consumed.
+ */
+static const JSONSchema *json_schema_builder_next(JSONSchemaBuilder *builder,
+                                                  GVariant *key,
+                                                  GVariant **entry_key,
+                                                  guint *slot)
+{
+    JSONSchemaFrame *frame = json_schema_builder_top(builder);
+    const JSONSchema *schema, *result = NULL;
+    const char *name;
+    guint i;
+
+    *entry_key = NULL;
+    *slot = 0;
+    if (!frame) {
+        return builder->schema;
+    }
+
+    schema = frame->schema;
+    *slot = frame->values->len;
+    if (json_schema_kind(schema) == 'a') {
+        result = schema->members[0];
+        if (json_schema_kind(result) == '{') {
+            *entry_key = json_schema_convert(result->members[0], key);
+            key = NULL;
+            if (!*entry_key) {
+                json_schema_error(builder, "key does not match type `%c'",
+                                  json_schema_kind(result->members[0]));
+                return NULL;
+            }
+            result = result->members[1];
+        }
+    } else if (!schema->names) {
+        if (*slot < schema->n_members) {
+            result = schema->members[*slot];
+        } else {
+            json_schema_error(builder, "too many elements for tuple of %u",
+                              schema->n_members);
+        }
+    } else {
+        name = g_variant_get_string(key, NULL);
+        for (i = 0; i < schema->n_members; i++) {
+            if (!strcmp(schema->names[i], name)) {
+                break;
+            }
+        }
+        if (i == schema->n_members) {
+            json_schema_error(builder, "unknown field `%s'", name);
+        } else if (g_ptr_array_index(frame->values, i)) {
+            json_schema_error(builder, "duplicate field `%s'", name);
+        } else {
+            result = schema->members[i];
+            *slot = i;
+        }
+    }
+
+    if (key) {
+        g_variant_unref(g_variant_ref_sink(key));
+    }
+    return result;
+}
+
+/* Put VALUE where json_schema_builder_next said, or in *RESULT.  */
+static void json_schema_builder_place(JSONSchemaBuilder *builder,
+                                      GVariant *entry_key, guint slot,
+                                      GVariant *value, GVariant **result)
+{
+    JSONSchemaFrame *frame = json_schema_builder_top(builder);
+
+    if (!frame) {
+        *result = value;
+        return;
+    }
+    if (entry_key) {
+        value = g_variant_new_dict_entry(entry_key, value);
+    }
+    g_variant_ref_sink(value);
+    if (slot == frame->values->len) {
+        g_ptr_array_add(frame->values, value);
+    } else {
+        g_ptr_array_index(frame->values, slot) = value;
+    }
+}
+
+bool json_schema_builder_open(JSONSchemaBuilder *builder, GVariant *key,
+                              char c)
+{
+    JSONSchemaFrame frame;
+    const JSONSchema *schema;
+    bool fits;
+    char kind;
+
+    if (json_schema_builder_untyped(builder)) {
+        json_builder_open(&builder->untyped, key, c);
+        return true;
+    }
+
+    frame.expected = json_schema_builder_next(builder, key, &frame.key,
+                                              &frame.slot);
+    if (!frame.expected) {
+        return false;
+    }
+    frame.schema = schema = json_schema_unwrap(frame.expected);
+    frame.values = NULL;
+    kind = json_schema_kind(schema);
+    if (kind == 'v') {
+        json_builder_open(&builder->untyped, NULL, c);
+        fits = true;
+    } else if (kind == 'a') {
+        fits = (c == '{') == (json_schema_kind(schema->members[0]) == '{');
+    } else if (kind == '(') {
+        fits = (c == '{') == (schema->names != NULL);
+    } else {
+        fits = false;
+    }
+    if (!fits) {
+        if (frame.key) {
+            g_variant_unref(g_variant_ref_sink(frame.key));
+        }
+        return json_schema_mismatch(builder, schema);
+    }
+
+    if (kind != 'v') {
+        frame.values = g_ptr_array_new_with_free_func(json_schema_value_free);
+        if (schema->names) {
+            g_ptr_array_set_size(frame.values, schema->n_members);
+        }
+    }
+    if (frame.key) {
+        g_variant_ref_sink(frame.key);
+    }
+    g_array_append_val(builder->frames, frame);
+    return true;
+}
+
+bool json_schema_builder_add(JSONSchemaBuilder *builder, GVariant *key,
+                             GVariant *value, GVariant **result)
+{
+    const JSONSchema *schema;
+    GVariant *entry_key;
+    guint slot;
+
+    *result = NULL;
+    if (json_schema_builder_untyped(builder)) {
+        json_builder_add(&builder->untyped, key, value);
+        return true;
+    }
+
+    schema = json_schema_builder_next(builder, key, &entry_key, &slot);
+    if (!schema) {
+        g_variant_unref(g_variant_ref_sink(value));
+        return false;
+    }
+    value = json_schema_convert(schema, value);
+    if (!value) {
+        if (entry_key) {
+            g_variant_unref(g_variant_ref_sink(entry_key));
+        }
+        return json_schema_mismatch(builder, schema);
+    }
+    json_schema_builder_place(builder, entry_key, slot, value, result);
+    return true;
+}
+
+/* Build the container of FRAME, or return NULL if it is incomplete.  */
+static GVariant *json_schema_builder_end(JSONSchemaBuilder *builder,
+                                         JSONSchemaFrame *frame)
+{
+    const JSONSchema *schema = frame->schema, *member;
+    GPtrArray *values = frame->values;
+    guint i;
+
+    if (json_schema_kind(schema) == 'a') {
+        return g_variant_new_array(g_variant_type_element(schema->type),
+                                   (GVariant **) values->pdata, values->len);
+    }
+
+    if (values->len < schema->n_members) {
+        json_schema_error(builder, "only %u elements for tuple of %u",
+                          values->len, schema->n_members);
+        return NULL;
+    }
+    for (i = 0; i < schema->n_members; i++) {
+        member = schema->members[i];
+        if (g_ptr_array_index(values, i)) {
+            continue;
+        }
+        if (json_schema_kind(member) != 'm') {
+            json_schema_error(builder, "missing field `%s'",
+                              schema->names[i]);
+            return NULL;
+        }
+        g_ptr_array_index(values, i) = g_variant_ref_sink(
+            g_variant_new_maybe(g_variant_type_element(member->type), NULL));
+    }
+    return g_variant_new_tuple((GVariant **) values->pdata, values->len);
+}
+
+bool json_schema_builder_close(JSONSchemaBuilder *builder, GVariant **result)
+{
+    JSONSchemaFrame frame = *json_schema_builder_top(builder);
+    GVariant *value;
+
+    *result = NULL;
+    if (json_schema_kind(frame.schema) == 'v') {
+        value = json_builder_close(&builder->untyped);
+        if (!value) {
+            return true;
+        }
+        value = g_variant_new_variant(value);
+    } else {
+        value = json_schema_builder_end(builder, &frame);
+        if (!value) {
+            return false;
+        }
+        g_ptr_array_free(frame.values, TRUE);
+    }
+
+    g_array_set_size(builder->frames, builder->frames->len - 1);
+    json_schema_builder_place(builder, frame.key, frame.slot,
+                              json_schema_wrap(frame.expected, value),
+                              result);
+    if (frame.key) {
+        g_variant_unref(frame.key);
+    }
+    return true;
+}
+
+void json_schema_builder_clear(JSONSchemaBuilder *builder)
+{
+    JSONSchemaFrame *frame;
+    guint i;
+
+    for (i = 0; i < builder->frames->len; i++) {
+        frame = &g_array_index(builder->frames, JSONSchemaFrame, i);
+        if (frame->values) {
+            g_ptr_array_free(frame->values, TRUE);
+        }
+        if (frame->key) {
+            g_variant_unref(frame->key);
+        }
+    }
+    g_array_set_size(builder->frames, 0);
+    json_builder_clear(&builder->untyped);
+}
+
+void json_schema_builder_destroy(JSONSchemaBuilder *builder)
+{
+    json_schema_builder_clear(builder);
+    g_array_free(builder->frames, TRUE);
+    json_builder_destroy(&builder->untyped);
+    g_free(builder->error);
+}
@@ -0,0 +1,73 @@
+/*
+ * Schema-directed JSON values
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_JSON_SCHEMA_H
+#define QEMU_JSON_SCHEMA_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include "json-builder.h"
+
+/*
+ * A GVariant type string, whose tuples can also name their members as
+ * in "(name:s id:x tags:as)".  A tuple with names is filled from an
+ * object by field name, and one without from an array by position;
+ * members of type m may be missing from the object.  Arrays of
+ * dictionary entries, whose keys can be s, o or g, are filled from
+ * objects.  A v holds the value as a{sv}, av or a scalar, like an
+ * untyped parse.
+ */
+typedef struct JSONSchema JSONSchema;
+
+/* Return NULL if STRING is not valid.  */
+JSONSchema *json_schema_new(const char *string);
+
+const GVariantType *json_schema_get_type(const JSONSchema *schema);
+
+void json_schema_free(JSONSchema *schema);
+
+/*
+ * Builds a value of the type of a schema, with the same calls as a
+ * JSONBuilder.  Each call returns false if the value does not fit the
+ * schema, and leaves the reason in ERROR.  Values are converted from
+ * what the parser produces to the type of the schema.
+ */
+typedef struct JSONSchemaBuilder
+{
+    const JSONSchema *schema;
+    /* The open containers, outermost first.  */
+    GArray *frames;
+    /* For containers inside a v.  */
+    JSONBuilder untyped;
+    char *error;
+} JSONSchemaBuilder;
+
+void json_schema_builder_init(JSONSchemaBuilder *builder,
+                              const JSONSchema *schema);
+
+bool json_schema_builder_open(JSONSchemaBuilder *builder, GVariant *key,
+                              char c);
+
+/*
+ * Unlike json_builder_add, VALUE can also be the whole value; it is
+ * then stored in *RESULT.
+ */
+bool json_schema_builder_add(JSONSchemaBuilder *builder, GVariant *key,
+                             GVariant *value, GVariant **result);
+
+/*
+ * Store the outermost container in *RESULT when it is closed, NULL
+ * otherwise.
+ */
+bool json_schema_builder_close(JSONSchemaBuilder *builder, GVariant **result);
+
+void json_schema_builder_clear(JSONSchemaBuilder *builder);
+
+void json_schema_builder_destroy(JSONSchemaBuilder *builder);
+
+#endif
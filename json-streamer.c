@@ -13,76 +13,989 @@
  *
  */
 
+#include <stdio.h>
+#include <string.h>
+
 #include "json-lexer.h"
+#include "json-parser.h"
 #include "json-streamer.h"
 
-static void json_message_process_token(JSONLexer *lexer, GString *token, JSONTokenType type, int x, int y)
+/*
+ * Priority lanes
+ *
+ * A lane is a GSource with a queue of values.  The first key of each
+ * top-level object picks its lane before the object is parsed.
+ */
+struct JSONMessageLane
+{
+    GSource source;
+    JSONMessageParser *parser;
+    char *key;
+    size_t key_len;
+    GQueue messages;
+};
+
+/* A value in a lane, and what FUNC can find out about it.  */
+typedef struct JSONMessage
+{
+    GVariant *value;
+    JSONLimit limit;
+    size_t value_start;
+    size_t value_end;
+    size_t drop_start;
+    size_t drop_end;
+    GBytes *raw;
+} JSONMessage;
+
+enum {
+    JSON_MESSAGE_LANE_START,
+    JSON_MESSAGE_LANE_KEY,
+    JSON_MESSAGE_LANE_DONE,
+};
+
+static void json_message_free(JSONMessage *msg)
+{
+    if (msg->value) {
+        g_variant_unref(g_variant_ref_sink(msg->value));
+    }
+    if (msg->raw) {
+        g_bytes_unref(msg->raw);
+    }
+    g_free(msg);
+}
+
+static gboolean json_message_lane_dispatch(GSource *source,
+                                           GSourceFunc callback,
+                                           gpointer user_data)
+{
+    JSONMessageLane *lane = (JSONMessageLane *) source;
+    JSONMessageParser *parser = lane->parser;
+    JSONMessage *msg = g_queue_pop_head(&lane->messages);
+    JSONLimit limit = parser->parser.limit;
+
+    if (g_queue_is_empty(&lane->messages)) {
+        g_source_set_ready_time(source, -1);
+    }
+
+    parser->parser.limit = msg->limit;
+    parser->value_start = msg->value_start;
+    parser->value_end = msg->value_end;
+    parser->drop_start = msg->drop_start;
+    parser->drop_end = msg->drop_end;
+    parser->raw_value = msg->raw;
+    parser->emit(parser, msg->value);
+    parser->parser.limit = limit;
+    parser->drop_start = parser->drop_end = 0;
+    parser->raw_value = NULL;
+
+    msg->value = NULL;
+    json_message_free(msg);
+    return G_SOURCE_CONTINUE;
+}
+
+static void json_message_lane_finalize(GSource *source)
+{
+    JSONMessageLane *lane = (JSONMessageLane *) source;
+
+    while (!g_queue_is_empty(&lane->messages)) {
+        json_message_free(g_queue_pop_head(&lane->messages));
+    }
+    g_free(lane->key);
+}
+
+static GSourceFuncs json_message_lane_funcs = {
+    .dispatch = json_message_lane_dispatch,
+    .finalize = json_message_lane_finalize,
+};
+
+/* Return the lane for an object whose first key is TOKEN, if not NULL.  */
+static JSONMessageLane *json_message_find_lane(JSONMessageParser *parser,
+                                               const JSONToken *token)
+{
+    JSONMessageLane *lane, *other = NULL;
+    guint i;
+
+    for (i = 0; i < parser->lanes->len; i++) {
+        lane = g_ptr_array_index(parser->lanes, i);
+        if (!lane->key) {
+            other = lane;
+        } else if (token && token->type == JSON_STRING &&
+                   token->len == lane->key_len + 2 &&
+                   !memcmp(token->str + 1, lane->key, lane->key_len)) {
+            return lane;
+        }
+    }
+    return other;
+}
+
+/* Pick the lane of the value that TOKEN is part of.  */
+static void json_message_classify(JSONMessageParser *parser,
+                                  const JSONToken *token)
+{
+    switch (parser->lane_state) {
+    case JSON_MESSAGE_LANE_START:
+        parser->lane = json_message_find_lane(parser, NULL);
+        parser->lane_state = token->type == JSON_OPERATOR &&
+            token->str[0] == '{' ? JSON_MESSAGE_LANE_KEY
+                                 : JSON_MESSAGE_LANE_DONE;
+        break;
+    case JSON_MESSAGE_LANE_KEY:
+        parser->lane = json_message_find_lane(parser, token);
+        parser->lane_state = JSON_MESSAGE_LANE_DONE;
+        break;
+    default:
+        break;
+    }
+}
+
+/* The next token starts a new top-level value.  */
+static void json_message_reset_lane(JSONMessageParser *parser)
+{
+    if (parser->lanes->len) {
+        parser->lane = json_message_find_lane(parser, NULL);
+        parser->lane_state = JSON_MESSAGE_LANE_START;
+    }
+}
+
+/* Pass VALUE to FUNC, or queue it in LANE.  */
+static void json_message_emit(JSONMessageParser *parser,
+                              JSONMessageLane *lane, GVariant *value)
+{
+    JSONMessage *msg;
+
+    if (!lane) {
+        parser->emit(parser, value);
+        return;
+    }
+
+    msg = g_new(JSONMessage, 1);
+    msg->value = value;
+    msg->limit = parser->parser.limit;
+    msg->value_start = parser->value_start;
+    msg->value_end = parser->value_end;
+    msg->drop_start = parser->drop_start;
+    msg->drop_end = parser->drop_end;
+    msg->raw = value && parser->raw ? json_message_parser_get_raw(parser)
+                                    : NULL;
+    g_queue_push_tail(&lane->messages, msg);
+    g_source_set_ready_time(&lane->source, 0);
+}
+
+/*
+ * Pipeline mode
+ *
+ * The tokens of each top-level value are copied into a job, which the
+ * pool parses with json_parser_parse.  Framing only needs to count
+ * brackets; the grammar is left to the workers.  Jobs are delivered
+ * from the head of PENDING, so the values come out in order whichever
+ * worker finishes first.
+ */
+struct JSONMessageJob
+{
+    GArray *tokens;
+    /* The text of the tokens, one after the other.  */
+    GString *text;
+    size_t start;
+    size_t end;
+    /* Protected by the lock of the JSONMessageParser.  */
+    GVariant *result;
+    bool done;
+    JSONLimit limit;
+    JSONMessageLane *lane;
+};
+
+static bool json_message_pipelined(JSONMessageParser *parser)
+{
+    return parser->pool && !parser->parser.split_depth &&
+           !parser->parser.schema && !parser->parser.builder.infer_arrays;
+}
+
+static bool json_message_is_open(const JSONToken *token)
+{
+    return token->type == JSON_OPERATOR &&
+        (token->str[0] == '{' || token->str[0] == '[');
+}
+
+static bool json_message_is_close(const JSONToken *token)
+{
+    return token->type == JSON_OPERATOR &&
+        (token->str[0] == '}' || token->str[0] == ']');
+}
+
+static JSONMessageJob *json_message_job_new(size_t start)
+{
+    JSONMessageJob *job = g_new0(JSONMessageJob, 1);
+
+    job->tokens = g_array_new(FALSE, FALSE, sizeof(JSONToken));
+    job->text = g_string_new(NULL);
+    job->start = start;
+    return job;
+}
+
+static void json_message_job_free(JSONMessageJob *job)
+{
+    g_array_free(job->tokens, TRUE);
+    g_string_free(job->text, TRUE);
+    g_free(job);
+}
+
+static void json_message_parse_job(gpointer data, gpointer user_data)
+{
+    JSONMessageJob *job = data;
+    JSONMessageParser *parser = user_data;
+    GVariant *result;
+
+    result = json_parser_parse(job->tokens, NULL);
+
+    g_mutex_lock(&parser->lock);
+    job->result = result;
+    job->done = true;
+    g_cond_signal(&parser->cond);
+    g_mutex_unlock(&parser->lock);
+}
+
+/*
+ * Pass FUNC the values that are done, in order.  Unless WAIT, stop at
+ * the first one that is not, provided that not too many are pending.
+ */
+static void json_message_deliver(JSONMessageParser *parser, bool wait)
+{
+    size_t drop_start = parser->drop_start;
+    size_t drop_end = parser->drop_end;
+    JSONMessageJob *job;
+
+    while ((job = g_queue_peek_head(&parser->pending))) {
+        g_mutex_lock(&parser->lock);
+        while (!job->done) {
+            if (!wait && parser->pending.length <= parser->max_pending) {
+                g_mutex_unlock(&parser->lock);
+                return;
+            }
+            g_cond_wait(&parser->cond, &parser->lock);
+        }
+        g_mutex_unlock(&parser->lock);
+
+        g_queue_pop_head(&parser->pending);
+        parser->parser.limit = job->limit;
+        parser->value_start = job->start;
+        parser->value_end = job->end;
+        /* Nothing of the job was dropped, whatever is being dropped now.  */
+        parser->drop_start = parser->drop_end = 0;
+        json_message_emit(parser, job->lane, job->result);
+        parser->drop_start = drop_start;
+        parser->drop_end = drop_end;
+        json_message_job_free(job);
+    }
+}
+
+/* Hand the value whose tokens were collected over to the pool.  */
+static void json_message_submit_job(JSONMessageParser *parser)
+{
+    JSONMessageJob *job = parser->job;
+    const char *str = job->text->str;
+    guint i;
+
+    /* The text does not move anymore, so the tokens can point into it.  */
+    for (i = 0; i < job->tokens->len; i++) {
+        JSONToken *token = &g_array_index(job->tokens, JSONToken, i);
+
+        token->str = str;
+        str += token->len;
+    }
+
+    parser->job = NULL;
+    job->lane = parser->lane;
+    g_queue_push_tail(&parser->pending, job);
+    g_thread_pool_push(parser->pool, job, NULL);
+}
+
+/* Queue NULL in place of the value whose tokens were being collected.  */
+static void json_message_fail_job(JSONMessageParser *parser, JSONLimit limit)
+{
+    JSONMessageJob *job = parser->job;
+
+    if (!job) {
+        job = json_message_job_new(0);
+    }
+    parser->job = NULL;
+    parser->depth = 0;
+    job->done = true;
+    job->limit = limit;
+    job->lane = parser->lane;
+    g_queue_push_tail(&parser->pending, job);
+}
+
+/*
+ * The same limits as json_parser_feed and json_parser_feed_partial
+ * check, except that the memory is what the job takes.
+ */
+static JSONLimit json_message_check_job(JSONMessageParser *parser,
+                                        size_t end, size_t len)
+{
+    const JSONLimits *limits = &parser->parser.limits;
+    JSONMessageJob *job = parser->job;
+    size_t n_tokens = 0, start = end - len, memory = len;
+
+    if (job) {
+        n_tokens = job->tokens->len;
+        start = job->start;
+        memory += job->text->len + n_tokens * sizeof(JSONToken);
+    }
+
+    if (limits->max_tokens && n_tokens > limits->max_tokens) {
+        return JSON_LIMIT_TOKENS;
+    }
+    if (limits->max_bytes && end - start > limits->max_bytes) {
+        return JSON_LIMIT_BYTES;
+    }
+    if (limits->max_memory && memory > limits->max_memory) {
+        return JSON_LIMIT_MEMORY;
+    }
+    return JSON_LIMIT_NONE;
+}
+
+/* Report the value as soon as it exceeds a limit, and skip the rest.  */
+static void json_message_reject(JSONMessageParser *parser, JSONLimit limit)
+{
+    fprintf(stderr, "parse error: value exceeds the maximum %s\n",
+            json_limit_name(limit));
+    parser->skipping = true;
+    parser->skip = parser->depth;
+    json_message_fail_job(parser, limit);
+}
+
+/* Like json_parser_skip.  */
+static void json_message_skip_token(JSONMessageParser *parser,
+                                    const JSONToken *token)
+{
+    if (json_message_is_open(token)) {
+        parser->skip++;
+    } else if (json_message_is_close(token) && parser->skip) {
+        parser->skip--;
+    }
+    if (!parser->skip) {
+        parser->skipping = false;
+    }
+}
+
+static void json_message_frame_token(JSONMessageParser *parser,
+                                     const JSONToken *token)
+{
+    const JSONLimits *limits = &parser->parser.limits;
+    JSONToken copy = *token;
+    JSONLimit limit;
+
+    if (parser->skipping) {
+        json_message_skip_token(parser, token);
+        return;
+    }
+
+    if (!parser->job) {
+        parser->job = json_message_job_new(json_token_end(token) - token->len);
+    }
+    copy.str = NULL;
+    parser->job->end = json_token_end(token);
+    g_array_append_val(parser->job->tokens, copy);
+    g_string_append_len(parser->job->text, token->str, token->len);
+
+    limit = json_message_check_job(parser, json_token_end(token), 0);
+    if (!limit && json_message_is_open(token) &&
+        limits->max_depth && parser->depth >= limits->max_depth) {
+        limit = JSON_LIMIT_DEPTH;
+    }
+    if (limit) {
+        json_message_reject(parser, limit);
+        json_message_skip_token(parser, token);
+        return;
+    }
+
+    if (json_message_is_open(token)) {
+        parser->depth++;
+    } else if (json_message_is_close(token) && parser->depth) {
+        parser->depth--;
+    }
+    if (!parser->depth) {
+        json_message_submit_job(parser);
+    }
+}
+
+/* Drop the value whose tokens are being collected, if any.  */
+static void json_message_reset_job(JSONMessageParser *parser)
+{
+    if (parser->job) {
+        json_message_job_free(parser->job);
+        parser->job = NULL;
+    }
+    parser->depth = 0;
+    parser->skipping = false;
+    parser->skip = 0;
+}
+
+/* Like json_parser_end, for the value whose tokens are being collected.  */
+static void json_message_end_job(JSONMessageParser *parser, bool truncated)
+{
+    bool skipping = parser->skipping;
+    bool pending = parser->job != NULL;
+    GVariant *result;
+
+    json_message_reset_job(parser);
+
+    /* This only prints the error; the parser itself has no tokens.  */
+    if (!skipping &&
+        json_parser_end(&parser->parser, pending || truncated, &result)) {
+        json_message_fail_job(parser, JSON_LIMIT_NONE);
+    }
+}
+
+static void json_message_process_token(JSONLexer *lexer, const JSONToken *token)
 {
     JSONMessageParser *parser = container_of(lexer, JSONMessageParser, lexer);
-    JSONToken *json_token;
+    GVariant *result;
+    bool idle;
 
-    if (type == JSON_OPERATOR) {
-        switch (token->str[0]) {
-        case '{':
-            parser->brace_count++;
-            break;
-        case '}':
-            parser->brace_count--;
-            break;
-        case '[':
-            parser->bracket_count++;
-            break;
-        case ']':
-            parser->bracket_count--;
+    if (parser->lanes->len) {
+        json_message_classify(parser, token);
+    }
+
+    if (json_message_pipelined(parser)) {
+        json_message_frame_token(parser, token);
+        json_message_deliver(parser, false);
+        idle = !parser->depth;
+    } else {
+        if (json_parser_feed(&parser->parser, token, &result)) {
+            parser->value_start = parser->parser.start;
+            parser->value_end = json_token_end(token);
+            json_message_emit(parser, parser->lane, result);
+        }
+        idle = !parser->parser.stack->len;
+    }
+    if (idle) {
+        json_message_reset_lane(parser);
+    }
+}
+
+void json_message_parser_init(JSONMessageParser *parser,
+                              void (*func)(JSONMessageParser *, GVariant *),
+                              va_list *ap, int flags)
+{
+    parser->emit = func;
+    json_parser_init(&parser->parser, ap);
+    parser->slice = 0;
+    parser->ndjson = false;
+    parser->line_error = false;
+    parser->at_end = false;
+    parser->offset = 0;
+    parser->resync = false;
+    parser->dropping = false;
+    parser->drop_reported = false;
+    parser->drop_depth = 0;
+    parser->drop_start = 0;
+    parser->drop_end = 0;
+    parser->value_start = 0;
+    parser->value_end = 0;
+    parser->raw = false;
+    g_queue_init(&parser->raw_chunks);
+    parser->raw_offset = 0;
+    parser->raw_value = NULL;
+    parser->lanes = g_ptr_array_new();
+    parser->lane = NULL;
+    parser->lane_state = JSON_MESSAGE_LANE_START;
+    parser->pool = NULL;
+    g_mutex_init(&parser->lock);
+    g_cond_init(&parser->cond);
+    g_queue_init(&parser->pending);
+    parser->max_pending = 0;
+    parser->job = NULL;
+    parser->depth = 0;
+    parser->skipping = false;
+    parser->skip = 0;
+
+    json_lexer_init(&parser->lexer, json_message_process_token, flags);
+}
+
+void json_message_parser_set_ndjson(JSONMessageParser *parser, bool ndjson)
+{
+    parser->ndjson = ndjson;
+}
+
+void json_message_parser_set_resync(JSONMessageParser *parser, bool resync)
+{
+    parser->resync = resync;
+}
+
+void json_message_parser_set_raw(JSONMessageParser *parser, bool raw)
+{
+    parser->raw = raw;
+    parser->raw_offset = parser->offset;
+}
+
+void json_message_parser_add_lane(JSONMessageParser *parser, const char *key,
+                                  int priority, GMainContext *context)
+{
+    GSource *source = g_source_new(&json_message_lane_funcs,
+                                   sizeof(JSONMessageLane));
+    JSONMessageLane *lane = (JSONMessageLane *) source;
+
+    lane->parser = parser;
+    lane->key = g_strdup(key);
+    lane->key_len = key ? strlen(key) : 0;
+    g_queue_init(&lane->messages);
+    g_source_set_priority(source, priority);
+    g_source_attach(source, context);
+    g_ptr_array_add(parser->lanes, lane);
+    json_message_reset_lane(parser);
+}
+
+void json_message_parser_set_split_depth(JSONMessageParser *parser,
+                                         size_t depth)
+{
+    json_parser_set_split_depth(&parser->parser, depth);
+}
+
+void json_message_parser_set_workers(JSONMessageParser *parser,
+                                     unsigned n_workers)
+{
+    if (parser->parser.ap || parser->pool || !n_workers) {
+        return;
+    }
+    parser->pool = g_thread_pool_new(json_message_parse_job, parser,
+                                     n_workers, FALSE, NULL);
+    /* Enough to keep the workers busy while FUNC runs.  */
+    parser->max_pending = 4 * n_workers;
+}
+
+void json_message_parser_set_limits(JSONMessageParser *parser,
+                                    const JSONLimits *limits)
+{
+    json_parser_set_limits(&parser->parser, limits);
+
+    parser->slice = limits->max_bytes;
+    if (limits->max_memory && (!parser->slice ||
+                               limits->max_memory < parser->slice)) {
+        parser->slice = limits->max_memory;
+    }
+}
+
+/* Apply the limits to the token that the lexer has not finished yet.  */
+static void json_message_check_partial(JSONMessageParser *parser)
+{
+    JSONLexer *lexer = &parser->lexer;
+    GVariant *result;
+    JSONLimit limit;
+
+    if (json_message_pipelined(parser)) {
+        if (!parser->skipping && lexer->token->len) {
+            limit = json_message_check_job(parser, lexer->offset,
+                                           lexer->token->len);
+            if (limit) {
+                json_message_reject(parser, limit);
+            }
+        }
+    } else if (json_parser_feed_partial(&parser->parser, lexer->offset,
+                                        lexer->token->len, &result)) {
+        json_message_emit(parser, parser->lane, result);
+    }
+
+    /* A token this long cannot be part of a valid value.  */
+    if (lexer->token->len > parser->slice) {
+        json_lexer_discard(lexer);
+    }
+}
+
+/* Feed BUFFER to the lexer, applying the limits if there are any.  */
+static int json_message_feed_lexer(JSONMessageParser *parser,
+                                   const char *buffer, size_t size)
+{
+    size_t n;
+    int ret;
+
+    if (!parser->slice) {
+        return json_lexer_feed(&parser->lexer, buffer, size);
+    }
+
+    /*
+     * Feed at most SLICE bytes at a time, so that the lexer does not
+     * buffer much more than the limits allow.
+     */
+    do {
+        n = MIN(size, parser->slice);
+        ret = json_lexer_feed(&parser->lexer, buffer, n);
+        if (ret < 0) {
+            return ret;
+        }
+        json_message_check_partial(parser);
+        buffer += n;
+        size -= n;
+    } while (size);
+    return 0;
+}
+
+/*
+ * Finish the current line, or the whole input, and get ready for more.
+ * A value or a token that was left unfinished is an error.
+ */
+static void json_message_end_line(JSONMessageParser *parser)
+{
+    JSONLexer *lexer = &parser->lexer;
+    GVariant *result;
+    bool truncated = parser->line_error || lexer->token->len;
+
+    if (json_message_pipelined(parser)) {
+        json_message_end_job(parser, truncated);
+    } else if (json_parser_end(&parser->parser, truncated, &result)) {
+        json_message_emit(parser, parser->lane, result);
+    }
+
+    json_message_reset_lane(parser);
+    json_lexer_reset(lexer);
+    if (parser->line_error) {
+        /* The rest of the line was not fed to the lexer.  */
+        lexer->offset = parser->offset;
+        lexer->x = 0;
+        lexer->y++;
+        parser->line_error = false;
+    }
+}
+
+/*
+ * Newlines are found with memchr, and each line is fed to the lexer
+ * together with its newline, which ends any number or keyword.  A line
+ * that leaves a value or a token unfinished, or that has a lexical
+ * error, is reported as a NULL value but does not affect the next one.
+ */
+static void json_message_feed_lines(JSONMessageParser *parser,
+                                    const char *buffer, size_t size)
+{
+    const char *nl;
+    size_t n;
+
+    while (size) {
+        nl = memchr(buffer, '\n', size);
+        n = nl ? nl + 1 - buffer : size;
+        if (!parser->line_error &&
+            json_message_feed_lexer(parser, buffer, n) < 0) {
+            parser->line_error = true;
+        }
+        parser->offset += n;
+        if (nl) {
+            json_message_end_line(parser);
+        }
+        buffer += n;
+        size -= n;
+    }
+}
+
+/* Return the bracket that closes the innermost container of JOB.  */
+static char json_message_job_close(JSONMessageJob *job)
+{
+    const char *str = job->text->str + job->text->len;
+    size_t depth = 0;
+    guint i = job->tokens->len;
+
+    while (i--) {
+        const JSONToken *token = &g_array_index(job->tokens, JSONToken, i);
+
+        str -= token->len;
+        if (token->type != JSON_OPERATOR) {
+            continue;
+        }
+        if (*str == '}' || *str == ']') {
+            depth++;
+        } else if ((*str == '{' || *str == '[') && !depth--) {
+            return *str + 2;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start dropping input after a lexical error at BAD.  The value that had
+ * it is dropped too, together with the token that the lexer was in.
+ */
+static void json_message_start_drop(JSONMessageParser *parser, char bad)
+{
+    JSONLexer *lexer = &parser->lexer;
+    JSONParser *p = &parser->parser;
+    char close = 0;
+
+    parser->dropping = true;
+    parser->drop_start = lexer->offset - 1 - lexer->token->len;
+    if (json_message_pipelined(parser)) {
+        parser->drop_reported = parser->skipping;
+        parser->drop_depth = parser->skipping ? parser->skip : parser->depth;
+        if (parser->job) {
+            parser->drop_start = parser->job->start;
+            if (!parser->skipping) {
+                close = json_message_job_close(parser->job);
+            }
+        }
+        json_message_reset_job(parser);
+    } else {
+        parser->drop_reported = json_parser_is_skipping(p);
+        parser->drop_depth = p->stack->len + p->skip;
+        if (p->n_tokens) {
+            parser->drop_start = p->start;
+        }
+        if (p->stack->len && !p->skip) {
+            close = p->stack->str[p->stack->len - 1] + 2;
+        }
+        json_parser_reset(p);
+    }
+    json_message_reset_lane(parser);
+    json_lexer_reset(lexer);
+
+    /*
+     * json_message_scan_drop starts after BAD, so count it here if it
+     * is a bracket.  A closing one must match the innermost container,
+     * which is not known while a rejected value is being skipped.
+     */
+    if (bad == '{' || bad == '[') {
+        parser->drop_depth++;
+    } else if (close && bad == close && !--parser->drop_depth) {
+        parser->dropping = false;
+    } else if (bad == '\n') {
+        parser->dropping = false;
+    }
+}
+
+/*
+ * Return how many bytes of BUFFER to drop: up to a newline, or to the
+ * bracket that closes the containers that were open when the error
+ * happened.  Strings are not recognized, so this is only a guess.
+ */
+static size_t json_message_scan_drop(JSONMessageParser *parser,
+                                     const char *buffer, size_t size)
+{
+    const char *p, *end = buffer + size;
+
+    if (!parser->drop_depth) {
+        p = memchr(buffer, '\n', size);
+        if (!p) {
+            return size;
+        }
+        goto found;
+    }
+
+    for (p = buffer; p < end; p++) {
+        switch (*p) {
+        case '\n':
+            goto found;
+        case '{': case '[':
+            parser->drop_depth++;
             break;
-        default:
+        case '}': case ']':
+            if (!--parser->drop_depth) {
+                goto found;
+            }
             break;
         }
     }
+    return size;
 
-    json_token = g_slice_new(JSONToken);
-    json_token->type = type;
-    json_token->str = g_strdup (token->str);
-    json_token->x = x;
-    json_token->y = y;
+found:
+    parser->dropping = false;
+    return p + 1 - buffer;
+}
 
-    if (!parser->tokens) {
-        parser->tokens = g_queue_new();
+static void json_message_end_drop(JSONMessageParser *parser)
+{
+    parser->dropping = false;
+    parser->drop_end = parser->lexer.offset;
+    fprintf(stderr, "parse error: dropped bytes %zu-%zu after invalid input\n",
+            parser->drop_start, parser->drop_end);
+
+    /* Values that were complete before the error come first.  */
+    json_message_deliver(parser, true);
+    if (!parser->drop_reported) {
+        parser->parser.limit = JSON_LIMIT_NONE;
+        json_message_emit(parser, parser->lane, NULL);
     }
-    g_queue_push_tail (parser->tokens, json_token);
-    if (parser->brace_count == 0 && parser->bracket_count == 0) {
-        parser->emit(parser, parser->tokens);
-        g_queue_free(parser->tokens);
-        parser->tokens = NULL;
+    parser->drop_start = parser->drop_end = 0;
+}
+
+static void json_message_feed_resync(JSONMessageParser *parser,
+                                     const char *buffer, size_t size)
+{
+    JSONLexer *lexer = &parser->lexer;
+    size_t start, n;
+
+    while (size) {
+        if (parser->dropping) {
+            n = json_message_scan_drop(parser, buffer, size);
+            json_lexer_skip(lexer, buffer, n);
+            if (!parser->dropping) {
+                json_message_end_drop(parser);
+            }
+        } else {
+            start = lexer->offset;
+            if (json_message_feed_lexer(parser, buffer, size) == 0) {
+                break;
+            }
+            /* The bad byte is the last one that was consumed.  */
+            n = lexer->offset - start;
+            json_message_start_drop(parser, buffer[n - 1]);
+            if (!parser->dropping) {
+                json_message_end_drop(parser);
+            }
+        }
+        buffer += n;
+        size -= n;
     }
 }
 
-void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, GQueue *))
+static int json_message_feed(JSONMessageParser *parser,
+                             const char *buffer, size_t size)
 {
-    parser->emit = func;
-    parser->brace_count = 0;
-    parser->bracket_count = 0;
-    parser->tokens = NULL;
+    int ret = 0;
 
-    json_lexer_init(&parser->lexer, json_message_process_token);
+    if (parser->ndjson) {
+        json_message_feed_lines(parser, buffer, size);
+    } else if (parser->resync) {
+        parser->offset += size;
+        json_message_feed_resync(parser, buffer, size);
+    } else {
+        parser->offset += size;
+        ret = json_message_feed_lexer(parser, buffer, size);
+    }
+    json_message_deliver(parser, true);
+    return ret;
+}
+
+/*
+ * Drop the buffers that precede both the value that is being parsed
+ * and the token that the lexer has not finished.
+ */
+static void json_message_trim_raw(JSONMessageParser *parser)
+{
+    JSONLexer *lexer = &parser->lexer;
+    size_t needed = lexer->offset - lexer->token->len;
+    GBytes *bytes;
+
+    if (json_message_pipelined(parser)) {
+        if (parser->job) {
+            needed = parser->job->start;
+        }
+    } else if (parser->parser.n_tokens) {
+        needed = parser->parser.start;
+    }
+
+    while ((bytes = g_queue_peek_head(&parser->raw_chunks)) &&
+           parser->raw_offset + g_bytes_get_size(bytes) <= needed) {
+        parser->raw_offset += g_bytes_get_size(bytes);
+        g_bytes_unref(g_queue_pop_head(&parser->raw_chunks));
+    }
+}
+
+GBytes *json_message_parser_get_raw(JSONMessageParser *parser)
+{
+    size_t start = parser->value_start, end = parser->value_end;
+    size_t offset = parser->raw_offset;
+    GByteArray *copy = NULL;
+    GList *l;
+
+    if (parser->raw_value) {
+        return g_bytes_ref(parser->raw_value);
+    }
+
+    for (l = parser->raw_chunks.head; l && offset < end; l = l->next) {
+        gsize size;
+        const guint8 *data = g_bytes_get_data(l->data, &size);
+
+        if (offset + size > start) {
+            size_t from = MAX(start, offset) - offset;
+            size_t to = MIN(end, offset + size) - offset;
+
+            if (!copy && to == end - offset) {
+                return g_bytes_new_from_bytes(l->data, from, to - from);
+            }
+            if (!copy) {
+                copy = g_byte_array_sized_new(end - start);
+            }
+            g_byte_array_append(copy, data + from, to - from);
+        }
+        offset += size;
+    }
+    return copy ? g_byte_array_free_to_bytes(copy) : NULL;
 }
 
 int json_message_parser_feed(JSONMessageParser *parser,
                              const char *buffer, size_t size)
 {
-    return json_lexer_feed(&parser->lexer, buffer, size);
+    GBytes *bytes;
+    int ret;
+
+    if (!parser->raw) {
+        return json_message_feed(parser, buffer, size);
+    }
+    bytes = g_bytes_new(buffer, size);
+    ret = json_message_parser_feed_bytes(parser, bytes);
+    g_bytes_unref(bytes);
+    return ret;
+}
+
+int json_message_parser_feed_bytes(JSONMessageParser *parser, GBytes *bytes)
+{
+    const char *buffer;
+    gsize size;
+    int ret;
+
+    buffer = g_bytes_get_data(bytes, &size);
+    if (!parser->raw) {
+        return json_message_feed(parser, buffer, size);
+    }
+    g_queue_push_tail(&parser->raw_chunks, g_bytes_ref(bytes));
+    ret = json_message_feed(parser, buffer, size);
+    json_message_trim_raw(parser);
+    return ret;
 }
 
 int json_message_parser_flush(JSONMessageParser *parser)
 {
-    return json_lexer_flush(&parser->lexer);
+    bool line_error = parser->line_error;
+    bool truncated;
+
+    /* A newline ends a number or keyword at the end of the input.  */
+    if (parser->dropping) {
+        json_message_end_drop(parser);
+    } else if (!parser->line_error &&
+               json_message_feed_lexer(parser, "\n", 1) < 0) {
+        parser->line_error = true;
+    }
+    truncated = parser->line_error || parser->lexer.token->len;
+    parser->at_end = !line_error;
+    json_message_end_line(parser);
+    parser->at_end = false;
+    json_message_deliver(parser, true);
+    if (parser->raw) {
+        json_message_trim_raw(parser);
+    }
+    return truncated ? -EINVAL : 0;
 }
 
 void json_message_parser_destroy(JSONMessageParser *parser)
 {
-    json_lexer_destroy(&parser->lexer);
-    if (parser->tokens) {
-	g_queue_free(parser->tokens);
+    guint i;
+
+    json_message_deliver(parser, true);
+    if (parser->job) {
+        json_message_job_free(parser->job);
+    }
+    if (parser->pool) {
+        g_thread_pool_free(parser->pool, FALSE, TRUE);
+    }
+    g_mutex_clear(&parser->lock);
+    g_cond_clear(&parser->cond);
+    while (!g_queue_is_empty(&parser->raw_chunks)) {
+        g_bytes_unref(g_queue_pop_head(&parser->raw_chunks));
     }
+    for (i = 0; i < parser->lanes->len; i++) {
+        GSource *source = g_ptr_array_index(parser->lanes, i);
+
+        g_source_destroy(source);
+        g_source_unref(source);
+    }
+    g_ptr_array_free(parser->lanes, TRUE);
+
+    json_lexer_destroy(&parser->lexer);
+    json_parser_destroy(&parser->parser);
 }
@@ -17,22 +17,164 @@
 #define QEMU_JSON_STREAMER_H
 
 #include "json-lexer.h"
+#include "json-parser.h"
 
+typedef struct JSONMessageJob JSONMessageJob;
+typedef struct JSONMessageLane JSONMessageLane;
+
+/*
+ * Tokens go straight from the lexer into the parser, and the value is
+ * emitted as soon as its last token is seen.  With workers, the tokens
+ * of each value are collected instead, and parsed by a thread pool.
+ */
 typedef struct JSONMessageParser
 {
-    void (*emit)(struct JSONMessageParser *parser, GQueue *tokens);
+    void (*emit)(struct JSONMessageParser *parser, GVariant *value);
     JSONLexer lexer;
-    int brace_count;
-    int bracket_count;
-    GQueue *tokens;
+    JSONParser parser;
+    /* With limits, the largest amount of data fed to the lexer at once.  */
+    size_t slice;
+    /* Newline-delimited mode; see json_message_parser_set_ndjson.  */
+    bool ndjson;
+    bool line_error;
+    /* Set while json_message_parser_flush reports an unfinished value.  */
+    bool at_end;
+    size_t offset;
+    /* Resynchronization; see json_message_parser_set_resync.  */
+    bool resync;
+    bool dropping;
+    /* The value with the error was already passed to FUNC as NULL.  */
+    bool drop_reported;
+    size_t drop_depth;
+    size_t drop_start;
+    size_t drop_end;
+    /* The bytes of the input that the value passed to FUNC came from.  */
+    size_t value_start;
+    size_t value_end;
+    /* Buffers that hold them; see json_message_parser_set_raw.  */
+    bool raw;
+    GQueue raw_chunks;
+    size_t raw_offset;
+    GBytes *raw_value;
+    /* Priority lanes, and the one for the current value.  */
+    GPtrArray *lanes;
+    JSONMessageLane *lane;
+    int lane_state;
+    /* Pipeline mode; see json_message_parser_set_workers.  */
+    GThreadPool *pool;
+    GMutex lock;
+    GCond cond;
+    /* Values handed to the pool, in arrival order.  */
+    GQueue pending;
+    size_t max_pending;
+    /* The value whose tokens are being collected, and its depth.  */
+    JSONMessageJob *job;
+    size_t depth;
+    /* Depth of the rejected value that is being skipped.  */
+    bool skipping;
+    size_t skip;
 } JSONMessageParser;
 
+/*
+ * FLAGS are passed to json_lexer_init, AP to json_parser_init.  FUNC
+ * receives each top-level value, or NULL for one that could not be
+ * parsed, and owns it.
+ */
 void json_message_parser_init(JSONMessageParser *parser,
-                              void (*func)(JSONMessageParser *, GQueue *));
+                              void (*func)(JSONMessageParser *, GVariant *),
+                              va_list *ap, int flags);
+
+/*
+ * With NDJSON, values cannot span lines and an error only affects the
+ * line it is on.  The end of a line also ends the value on it, and
+ * errors are reported to FUNC as NULL rather than by the return value
+ * of json_message_parser_feed.
+ */
+void json_message_parser_set_ndjson(JSONMessageParser *parser, bool ndjson);
+
+/*
+ * After a lexical error, drop the input up to the next newline or to
+ * the bracket that closes the value with the error, and go on from
+ * there instead of failing.  FUNC then receives NULL, unless it did
+ * already for a limit, and the dropped bytes are from
+ * parser->drop_start to parser->drop_end, which are equal for other
+ * values.  Has no effect in NDJSON mode, where a
+ * lexical error only drops its line.
+ */
+void json_message_parser_set_resync(JSONMessageParser *parser, bool resync);
+
+/*
+ * Pass FUNC the values nested DEPTH levels deep, for example each
+ * element of a huge top-level array for DEPTH == 1, as soon as they are
+ * complete.  See json_parser_set_split_depth.
+ */
+void json_message_parser_set_split_depth(JSONMessageParser *parser,
+                                         size_t depth);
+
+/*
+ * Reject values that exceed LIMITS as soon as they do so, rather than
+ * when they end.  FUNC then receives NULL, and parser->parser.limit
+ * says which limit was hit.  The lexer is also kept from buffering a
+ * token longer than max_bytes or max_memory.
+ */
+void json_message_parser_set_limits(JSONMessageParser *parser,
+                                    const JSONLimits *limits);
+
+/*
+ * Parse values on N_WORKERS threads.  The thread that feeds the parser
+ * only splits the tokens into values and checks the limits; FUNC is
+ * still called on that thread, in the order in which the values
+ * arrived, before json_message_parser_feed returns.  Values in the same
+ * buffer are parsed in parallel, so this pays off when each buffer has
+ * many of them.  Call it before feeding any data.  Has no effect on
+ * parsers with escapes, a split depth or a schema.
+ */
+void json_message_parser_set_workers(JSONMessageParser *parser,
+                                     unsigned n_workers);
+
+/*
+ * Keep the input around until the values in it are emitted, so that
+ * FUNC can call json_message_parser_get_raw.  Buffers passed to
+ * json_message_parser_feed_bytes are referenced, other buffers are
+ * copied.
+ */
+void json_message_parser_set_raw(JSONMessageParser *parser, bool raw);
+
+/*
+ * Return the bytes from parser->value_start to parser->value_end, that
+ * is the text of the value that was passed to FUNC, which must be
+ * non-NULL.  Only valid inside FUNC.  If the value lies within one
+ * buffer, the result is a slice of it and no data is copied.
+ */
+GBytes *json_message_parser_get_raw(JSONMessageParser *parser);
+
+/*
+ * Queue top-level objects whose first key is KEY, and the values split
+ * out of them, for a GSource with PRIORITY that is attached to CONTEXT.
+ * The GSource passes them to FUNC one per dispatch, so lanes with a
+ * higher priority can go first even when they are busy.  A NULL KEY
+ * adds a lane for all other values; without one, they are passed to
+ * FUNC right away.  Keys are compared with the text of the token, so
+ * they cannot use escapes.  CONTEXT must be run by the thread that
+ * feeds the parser.  FUNC can look at the same fields and call the
+ * same functions as when it is called from json_message_parser_feed.
+ */
+void json_message_parser_add_lane(JSONMessageParser *parser, const char *key,
+                                  int priority, GMainContext *context);
 
 int json_message_parser_feed(JSONMessageParser *parser,
                              const char *buffer, size_t size);
 
+int json_message_parser_feed_bytes(JSONMessageParser *parser, GBytes *bytes);
+
+/*
+ * End the input.  A value that is left incomplete is passed to FUNC as
+ * NULL, with parser->at_end set unless its line already had a lexical
+ * error.  Errors in a number or keyword that only the end of the input
+ * ends are reported as usual, before at_end is set.  Return -EINVAL if
+ * the input ended in the middle of a token or, in NDJSON mode, of a
+ * line with a lexical error.
+ */
 int json_message_parser_flush(JSONMessageParser *parser);
 
 void json_message_parser_destroy(JSONMessageParser *parser);
@@ -0,0 +1,248 @@
+/*
+ * Compiled format strings for g_variant_from_jsonf
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ * The format is lexed and parsed once, by a JSONParser that records
+ * each open, add and close instead of passing it to its JSONBuilder.
+ * Expanding the template replays them on a new JSONBuilder, so the
+ * value is written in serialized form directly, like a parsed one.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "json-lexer.h"
+#include "json-parser.h"
+#include "json-template.h"
+
+typedef struct JSONTemplateOp
+{
+    /*
+     * '{' or '[' to open a container, '}' to close one, 'v' to add, or
+     * 's' for the holes of a value that is not kept.
+     */
+    char c;
+    /* Constants, holes or NULL.  */
+    GVariant *key;
+    GVariant *value;
+} JSONTemplateOp;
+
+struct JSONTemplate
+{
+    GArray *ops;
+    /* The 's' ops, which come first.  */
+    guint n_skips;
+    /* The containers that are open while recording.  */
+    size_t depth;
+};
+
+typedef struct JSONTemplateCompiler
+{
+    JSONLexer lexer;
+    JSONParser parser;
+    bool error;
+} JSONTemplateCompiler;
+
+static void json_template_truncate(JSONTemplate *template, guint len)
+{
+    JSONTemplateOp *op;
+    guint i;
+
+    for (i = len; i < template->ops->len; i++) {
+        op = &g_array_index(template->ops, JSONTemplateOp, i);
+        if (op->key) {
+            g_variant_unref(op->key);
+        }
+        if (op->value) {
+            g_variant_unref(op->value);
+        }
+    }
+    g_array_set_size(template->ops, len);
+}
+
+/* Return VALUE if it is a hole, else drop it.  */
+static GVariant *json_template_hole(GVariant *value)
+{
+    if (value && g_variant_is_of_type(value, G_VARIANT_TYPE_HANDLE)) {
+        return value;
+    }
+    if (value) {
+        g_variant_unref(value);
+    }
+    return NULL;
+}
+
+/*
+ * Drop the value that was recorded, except for its holes: the
+ * arguments for them come before those of the next value, and must
+ * still be taken.
+ */
+static void json_template_skip_value(JSONTemplate *template)
+{
+    JSONTemplateOp *op, *skip;
+    guint i;
+
+    for (i = template->n_skips; i < template->ops->len; i++) {
+        op = &g_array_index(template->ops, JSONTemplateOp, i);
+        skip = &g_array_index(template->ops, JSONTemplateOp,
+                              template->n_skips);
+        skip->key = json_template_hole(op->key);
+        skip->value = json_template_hole(op->value);
+        skip->c = 's';
+        if (skip->key || skip->value) {
+            template->n_skips++;
+        }
+    }
+    g_array_set_size(template->ops, template->n_skips);
+}
+
+static void json_template_push(JSONTemplate *template, char c,
+                               GVariant *key, GVariant *value)
+{
+    JSONTemplateOp op = {
+        .c = c,
+        .key = key ? g_variant_ref_sink(key) : NULL,
+        .value = value ? g_variant_ref_sink(value) : NULL,
+    };
+
+    /* Like g_variant_from_jsonv, keep the last top-level value.  */
+    if (!template->depth && c != '}') {
+        json_template_skip_value(template);
+    }
+    g_array_append_val(template->ops, op);
+}
+
+void json_template_open(JSONTemplate *template, GVariant *key, char c)
+{
+    json_template_push(template, c, key, NULL);
+    template->depth++;
+}
+
+void json_template_add(JSONTemplate *template, GVariant *key,
+                       GVariant *value)
+{
+    json_template_push(template, 'v', key, value);
+}
+
+void json_template_close(JSONTemplate *template)
+{
+    template->depth--;
+    json_template_push(template, '}', NULL, NULL);
+}
+
+static void json_template_token(JSONLexer *lexer, const JSONToken *token)
+{
+    JSONTemplateCompiler *s = container_of(lexer, JSONTemplateCompiler,
+                                           lexer);
+    GVariant *result;
+
+    /* Nothing is built, so the parser only returns 1 for errors.  */
+    if (json_parser_feed(&s->parser, token, &result)) {
+        s->error = true;
+    }
+}
+
+JSONTemplate *json_template_new(const char *format)
+{
+    JSONTemplateCompiler s = {};
+    JSONTemplate *template = g_new0(JSONTemplate, 1);
+    GVariant *result;
+    bool truncated;
+
+    template->ops = g_array_new(FALSE, FALSE, sizeof(JSONTemplateOp));
+    json_lexer_init(&s.lexer, json_template_token,
+                    JSON_LEXER_ESCAPES | JSON_LEXER_LAZY_POSITION);
+    json_parser_init(&s.parser, NULL);
+    json_parser_set_template(&s.parser, template);
+
+    /* Like json_message_parser_flush, end a number with a newline.  */
+    truncated = json_lexer_feed(&s.lexer, format, strlen(format)) < 0 ||
+                json_lexer_feed(&s.lexer, "\n", 1) < 0 ||
+                s.lexer.token->len;
+    if (json_parser_end(&s.parser, truncated, &result)) {
+        s.error = true;
+    }
+    json_parser_destroy(&s.parser);
+    json_lexer_destroy(&s.lexer);
+
+    if (s.error || template->ops->len == template->n_skips) {
+        json_template_free(template);
+        return NULL;
+    }
+    return template;
+}
+
+/* Return VALUE, or the argument for it if it is a hole.  */
+static GVariant *json_template_fill(GVariant *value, va_list *ap)
+{
+    if (!value || !g_variant_is_of_type(value, G_VARIANT_TYPE_HANDLE)) {
+        return value;
+    }
+    return json_parser_escape_value(g_variant_get_handle(value), ap);
+}
+
+/* Take the argument for VALUE if it is a hole, and drop it.  */
+static void json_template_skip(GVariant *value, va_list *ap)
+{
+    value = json_template_fill(value, ap);
+    if (value) {
+        g_variant_unref(g_variant_ref_sink(value));
+    }
+}
+
+GVariant *json_template_expand(const JSONTemplate *template, va_list *ap)
+{
+    JSONTemplateOp *op = &g_array_index(template->ops, JSONTemplateOp, 0);
+    JSONBuilder builder;
+    GVariant *key, *value = NULL;
+    GBytes *bytes;
+    guint i;
+
+    for (i = 0; i < template->n_skips; i++, op++) {
+        json_template_skip(op->key, ap);
+        json_template_skip(op->value, ap);
+    }
+
+    if (op->c == 'v') {
+        /* A scalar on its own; give the caller a value of its own.  */
+        value = json_template_fill(op->value, ap);
+        if (value != op->value) {
+            return value;
+        }
+        bytes = g_variant_get_data_as_bytes(value);
+        value = g_variant_new_from_bytes(g_variant_get_type(value), bytes,
+                                         TRUE);
+        g_bytes_unref(bytes);
+        return value;
+    }
+
+    json_builder_init(&builder);
+    for (; i < template->ops->len; i++, op++) {
+        /* The key comes first in the format, so take its argument first.  */
+        key = json_template_fill(op->key, ap);
+        switch (op->c) {
+        case '{':
+        case '[':
+            json_builder_open(&builder, key, op->c);
+            break;
+        case '}':
+            value = json_builder_close(&builder);
+            break;
+        default:
+            json_builder_add(&builder, key, json_template_fill(op->value, ap));
+            break;
+        }
+    }
+    json_builder_destroy(&builder);
+    return value;
+}
+
+void json_template_free(JSONTemplate *template)
+{
+    json_template_truncate(template, 0);
+    g_array_free(template->ops, TRUE);
+    g_free(template);
+}
@@ -0,0 +1,44 @@
+/*
+ * Compiled format strings for g_variant_from_jsonf
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_JSON_TEMPLATE_H
+#define QEMU_JSON_TEMPLATE_H
+
+#include <glib.h>
+#include <stdarg.h>
+
+/*
+ * A format string parsed once: the JSONBuilder calls that build its
+ * value, with the constant keys and values already converted and a
+ * hole for each escape.  Expanding it only takes the arguments and
+ * writes the value, without lexing or parsing the format again.
+ */
+typedef struct JSONTemplate JSONTemplate;
+
+/* Return NULL if FORMAT is not valid.  */
+JSONTemplate *json_template_new(const char *format);
+
+/* Fill the holes from AP, in the order of the escapes in the format.  */
+GVariant *json_template_expand(const JSONTemplate *template, va_list *ap);
+
+void json_template_free(JSONTemplate *template);
+
+/*
+ * The calls that json-parser.c makes while recording a template.  They
+ * consume floating references to KEY and VALUE like the JSONBuilder
+ * calls.  A hole is a handle whose value is the JSONEscape of its
+ * escape; only JSON_ESCAPE_STRING can be a key.
+ */
+void json_template_open(JSONTemplate *template, GVariant *key, char c);
+
+void json_template_add(JSONTemplate *template, GVariant *key,
+                       GVariant *value);
+
+void json_template_close(JSONTemplate *template);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Incremental UTF-8 validation
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "json-utf8.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void json_utf8_init(JSONUTF8State *s)
+{
+    s->need = 0;
+    s->lo = 0x80;
+    s->hi = 0xBF;
+}
+
+/*
+ * Return the length of the longest ASCII prefix of BUFFER.  JSON is
+ * mostly ASCII even when it carries non-English text, so most of the
+ * input is only looked at here.
+ */
+static size_t json_utf8_scan_ascii(const char *buffer, size_t size)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        uint32_t mask = _mm256_movemask_epi8(v);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+        uint32_t mask = _mm_movemask_epi8(v);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i < size && !((uint8_t)buffer[i] & 0x80); i++) {
+        continue;
+    }
+    return i;
+}
+
+/*
+ * Start a multi-byte character with lead byte CH.  The bounds on the
+ * second byte exclude overlong forms (E0, F0), surrogates (ED) and
+ * code points above U+10FFFF (F4).
+ */
+static bool json_utf8_lead(JSONUTF8State *s, uint8_t ch)
+{
+    if (ch < 0xC2 || ch > 0xF4) {
+        return false;
+    }
+
+    s->lo = 0x80;
+    s->hi = 0xBF;
+    if (ch < 0xE0) {
+        s->need = 1;
+    } else if (ch < 0xF0) {
+        s->need = 2;
+        if (ch == 0xE0) {
+            s->lo = 0xA0;
+        } else if (ch == 0xED) {
+            s->hi = 0x9F;
+        }
+    } else {
+        s->need = 3;
+        if (ch == 0xF0) {
+            s->lo = 0x90;
+        } else if (ch == 0xF4) {
+            s->hi = 0x8F;
+        }
+    }
+    return true;
+}
+
+size_t json_utf8_validate(JSONUTF8State *s, const char *buffer, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
+        uint8_t ch;
+
+        if (!s->need) {
+            i += json_utf8_scan_ascii(buffer + i, size - i);
+            if (i == size) {
+                break;
+            }
+            if (!json_utf8_lead(s, buffer[i])) {
+                return i;
+            }
+            i++;
+            continue;
+        }
+
+        ch = buffer[i];
+        if (ch < s->lo || ch > s->hi) {
+            return i;
+        }
+        s->need--;
+        s->lo = 0x80;
+        s->hi = 0xBF;
+        i++;
+    }
+    return size;
+}
@@ -0,0 +1,43 @@
+/*
+ * Incremental UTF-8 validation
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_JSON_UTF8_H
+#define QEMU_JSON_UTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * NEED is the number of continuation bytes that are still expected
+ * for the current character; the next one must be between LO and HI.
+ * This is enough to resume validation in the middle of a character,
+ * so a document can be validated one chunk at a time.
+ */
+typedef struct JSONUTF8State
+{
+    uint8_t need;
+    uint8_t lo, hi;
+} JSONUTF8State;
+
+void json_utf8_init(JSONUTF8State *s);
+
+/*
+ * Validate SIZE more bytes of input.  Return the offset of the first
+ * byte that is not valid UTF-8, or SIZE if there is none.  Overlong
+ * forms, surrogates and code points above U+10FFFF are rejected.
+ */
+size_t json_utf8_validate(JSONUTF8State *s, const char *buffer, size_t size);
+
+/* Return whether the input so far did not end in the middle of a character.  */
+static inline bool json_utf8_complete(const JSONUTF8State *s)
+{
+    return s->need == 0;
+}
+
+#endif